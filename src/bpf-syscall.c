@@ -17,6 +17,7 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -57,7 +58,8 @@ int bpf_prog_load(enum bpf_prog_type type,
 	return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
 }
 
-int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries)
+int bpf_map_create_flags(enum bpf_map_type type, int key_sz, int val_sz,
+			 int entries, uint32_t flags)
 {
 	union bpf_attr attr;
 
@@ -69,10 +71,16 @@ int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries)
 	attr.key_size = key_sz;
 	attr.value_size = val_sz;
 	attr.max_entries = entries;
+	attr.map_flags = flags;
 
 	return syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
 }
 
+int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries)
+{
+	return bpf_map_create_flags(type, key_sz, val_sz, entries, 0);
+}
+
 
 static int bpf_map_op(enum bpf_cmd cmd, int fd,
 		      void *key, void *val_or_next, int flags)
@@ -107,6 +115,38 @@ int bpf_map_next(int fd, void *key, void *next_key)
 	return bpf_map_op(BPF_MAP_GET_NEXT_KEY, fd, key, next_key, 0);
 }
 
+#ifdef LINUX_HAS_MAP_BATCH
+int bpf_map_lookup_batch(int fd, void *in_batch, void *out_batch,
+			 void *keys, void *vals, uint32_t *count)
+{
+	union bpf_attr attr;
+	int ret;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.batch.map_fd    = fd;
+	attr.batch.in_batch  = ptr_to_u64(in_batch);
+	attr.batch.out_batch = ptr_to_u64(out_batch);
+	attr.batch.keys      = ptr_to_u64(keys);
+	attr.batch.values    = ptr_to_u64(vals);
+	attr.batch.count     = *count;
+
+	/* count is updated even when the end of the map is reached,
+	 * which is reported as ENOENT. */
+	ret = syscall(__NR_bpf, BPF_MAP_LOOKUP_BATCH, &attr, sizeof(attr));
+	*count = attr.batch.count;
+	return ret;
+}
+#else
+int bpf_map_lookup_batch(int fd, void *in_batch, void *out_batch,
+			 void *keys, void *vals, uint32_t *count)
+{
+	*count = 0;
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
 long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 		     int cpu, int group_fd, unsigned long flags)
 {
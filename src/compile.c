@@ -88,6 +88,14 @@ static const char *bpf_func_name(enum bpf_func_id id)
 		return "perf_event_output";
 	case BPF_FUNC_probe_read:
 		return "probe_read";
+#ifdef LINUX_HAS_VARLEN
+	case BPF_FUNC_probe_read_str:
+		return "probe_read_str";
+#endif
+#ifdef LINUX_HAS_RINGBUF
+	case BPF_FUNC_ringbuf_output:
+		return "ringbuf_output";
+#endif
 	case BPF_FUNC_trace_printk:
 		return "trace_printk";
 	default:
@@ -162,7 +170,7 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 	case BPF_ST:
 	case BPF_STX:
 		off = OFF_DST;
-		fputs("st", stderr);
+		fputs(BPF_MODE(insn.code) == BPF_XADD ? "xadd" : "st", stderr);
 		dump_size(insn.code);
 		break;
 
@@ -255,7 +263,7 @@ unknown:
 	fprintf(stderr, "data\t0x%16.16" PRIx64 "\n", *((uint64_t *)&insn));
 }
 
-static void emit_at(prog_t *prog, struct bpf_insn *at, struct bpf_insn insn)
+void emit_at(prog_t *prog, struct bpf_insn *at, struct bpf_insn insn)
 {
 	if (G.dump)
 		dump_insn(insn, at - prog->insns);
@@ -487,36 +495,152 @@ int emit_read_raw(prog_t *prog, ssize_t to, int from, size_t size)
 	return 0;
 }
 
-int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val)
+/* sizes computed at run time must be provably within bounds before
+ * they are passed to a helper. negative values are clamped to max. */
+int emit_bound(prog_t *prog, int reg, int32_t max)
+{
+	emit(prog, JMP_IMM(BPF_JGT, reg, max, 1));
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 1));
+	emit(prog, MOV_IMM(reg, max));
+	return 0;
+}
+
+/* load the map into r1. probes write to double buffered maps
+ * through the buffer selected by the current epoch, so that the
+ * other one can be read and cleared without racing with them. */
+static void emit_ld_map(prog_t *prog, node_t *map)
+{
+	sym_t *s = sym_from_node(map);
+#ifdef LINUX_HAS_MAP_VALUE
+	node_t *script;
+
+	if (s->map->fd1) {
+		script = node_get_script(map);
+
+		emit_ld_mapval(prog, BPF_REG_1, script->dyn->script.epochfd, 0);
+		emit(prog, LDXW(BPF_REG_1, 0, BPF_REG_1));
+		emit(prog, JMP_IMM(BPF_JNE, BPF_REG_1, 0, 3));
+		emit_ld_mapfd(prog, BPF_REG_1, s->map->fd);
+		emit(prog, JMP_IMM(BPF_JA, 0, 0, 2));
+		emit_ld_mapfd(prog, BPF_REG_1, s->map->fd1);
+		return;
+	}
+#endif
+	emit_ld_mapfd(prog, BPF_REG_1, s->map->fd);
+}
+
+static int __emit_map_update(prog_t *prog, node_t *map, ssize_t key,
+			     ssize_t val, int flags)
 {
-	emit_ld_mapfd(prog, BPF_REG_1, fd);
+	emit_ld_map(prog, map);
 	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2, key));
 	emit(prog, MOV(BPF_REG_3, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_3, val));
-	emit(prog, MOV_IMM(BPF_REG_4, 0));
+	emit(prog, MOV_IMM(BPF_REG_4, flags));
 	emit(prog, CALL(BPF_FUNC_map_update_elem));
 	return 0;
 }
 
-int emit_map_delete_raw(prog_t *prog, int fd, ssize_t key)
+int emit_map_update_raw(prog_t *prog, node_t *map, ssize_t key, ssize_t val)
+{
+	return __emit_map_update(prog, map, key, val, BPF_ANY);
+}
+
+int emit_map_delete_raw(prog_t *prog, node_t *map, ssize_t key)
 {
-	emit_ld_mapfd(prog, BPF_REG_1, fd);
+	emit_ld_map(prog, map);
 	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2, key));
 	emit(prog, CALL(BPF_FUNC_map_delete_elem));
 	return 0;
 }
 
-int emit_map_lookup_raw(prog_t *prog, int fd, ssize_t addr)
+int emit_map_lookup_raw(prog_t *prog, node_t *map, ssize_t addr)
 {
-	emit_ld_mapfd(prog, BPF_REG_1, fd);
+	emit_ld_map(prog, map);
 	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2, addr));
 	emit(prog, CALL(BPF_FUNC_map_lookup_elem));
 	return 0;
 }
 
+static void __emit_map_inplace(prog_t *prog, node_t *map, ssize_t key,
+			       ssize_t val, inplace_t update,
+			       struct bpf_insn **miss)
+{
+	emit_map_lookup_raw(prog, map, key);
+
+	*miss = prog->ip;
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+
+	update(prog, val);
+}
+
+/* merge the value at the map's value location on the stack into the
+ * entry at the map's key, through the pointer returned by lookup,
+ * i.e. one hash operation per update. on a miss, the stack value is
+ * inserted as is. the insert does not overwrite an entry that
+ * another cpu created in the meantime, that one is merged into
+ * instead. */
+int emit_map_inplace(prog_t *prog, node_t *map, inplace_t update)
+{
+	ssize_t key = map->map.rec->dyn->addr, val = map->dyn->addr;
+	struct bpf_insn *miss, *hit, *inserted, *lost;
+
+	__emit_map_inplace(prog, map, key, val, update, &miss);
+	hit = prog->ip;
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 0));
+
+	emit_at(prog, miss, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, prog->ip - miss - 1));
+	__emit_map_update(prog, map, key, val, BPF_NOEXIST);
+	inserted = prog->ip;
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+
+	/* lost the race to insert, the entry exists now */
+	__emit_map_inplace(prog, map, key, val, update, &lost);
+
+	emit_at(prog, lost, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, prog->ip - lost - 1));
+	emit_at(prog, inserted, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, prog->ip - inserted - 1));
+	emit_at(prog, hit, JMP_IMM(BPF_JA, 0, 0, prog->ip - hit - 1));
+	return 0;
+}
+
+static void emit_xadd_update(prog_t *prog, ssize_t val)
+{
+	emit(prog, LDXDW(BPF_REG_1, val, BPF_REG_10));
+	emit(prog, XADDDW(BPF_REG_0, 0, BPF_REG_1));
+}
+
+/* add the int64 at the map's value location on the stack to the
+ * entry at the map's key. */
+int emit_map_xadd(prog_t *prog, node_t *map)
+{
+	return emit_map_inplace(prog, map, emit_xadd_update);
+}
+
+/* leaves a pointer to the value at the map's key in r0. a missing
+ * entry is first inserted with a zeroed value. r0 is only NULL if
+ * the map is full. */
+int emit_map_lookup_or_insert(prog_t *prog, node_t *map)
+{
+	ssize_t key = map->map.rec->dyn->addr, val = map->dyn->addr;
+	struct bpf_insn *hit;
+
+	emit_map_lookup_raw(prog, map, key);
+	hit = prog->ip;
+	emit(prog, JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0));
+
+	/* if another cpu got there first, the insert fails and we
+	 * use its entry. */
+	emit_stack_zero(prog, map);
+	__emit_map_update(prog, map, key, val, BPF_NOEXIST);
+	emit_map_lookup_raw(prog, map, key);
+
+	emit_at(prog, hit, JMP_IMM(BPF_JNE, BPF_REG_0, 0, prog->ip - hit - 1));
+	return 0;
+}
+
 int emit_rec_load(prog_t *prog, node_t *n)
 {
 	node_t *c;
@@ -535,9 +659,95 @@ int emit_rec_load(prog_t *prog, node_t *n)
 	return 0;
 }
 
+/* functions that evaluate to the same value every time they are
+ * called from the same probe invocation. */
+static int func_is_stable(const func_t *func)
+{
+	static const char *stable[] = {
+		"arg", "comm", "cpu", "func", "gid", "pid", "reg", "retval",
+		"tid", "uid", NULL
+	};
+	const char **name;
+
+	for (name = stable; *name; name++)
+		if (!strcmp(func->name, *name))
+			return 1;
+
+	return 0;
+}
+
+/* a and b are the same side effect free expression, i.e. they are
+ * guaranteed to evaluate to the same value. */
+static int node_same_pure(node_t *a, node_t *b)
+{
+	node_t *ac, *bc;
+
+	if (a->type != b->type)
+		return 0;
+
+	switch (a->type) {
+	case TYPE_INT:
+		return a->integer == b->integer;
+	case TYPE_STR:
+	case TYPE_VAR:
+		return !strcmp(a->string, b->string);
+	case TYPE_BINOP:
+		return a->binop.op == b->binop.op &&
+			node_same_pure(a->binop.left, b->binop.left) &&
+			node_same_pure(a->binop.right, b->binop.right);
+	case TYPE_CALL:
+		if (a->dyn->call.func != b->dyn->call.func ||
+		    !func_is_stable(a->dyn->call.func))
+			return 0;
+
+		ac = a->call.vargs;
+		bc = b->call.vargs;
+		goto vargs;
+	case TYPE_REC:
+		ac = a->rec.vargs;
+		bc = b->rec.vargs;
+		goto vargs;
+	default:
+		return 0;
+	}
+
+vargs:
+	for (; ac && bc; ac = ac->next, bc = bc->next)
+		if (!node_same_pure(ac, bc))
+			return 0;
+
+	return !ac && !bc;
+}
+
+/* @a[k] = @a[k] + x, or x + @a[k], can add x to the value in
+ * place. returns x, or NULL if assign is not of that form. */
+static node_t *assign_xadd_operand(node_t *assign)
+{
+	node_t *lval = assign->assign.lval, *expr = assign->assign.expr;
+	node_t *l, *r;
+
+	if (!expr || lval->type != TYPE_MAP || expr->type != TYPE_BINOP ||
+	    expr->binop.op != OP_ADD ||
+	    lval->dyn->type != TYPE_INT || expr->dyn->type != TYPE_INT)
+		return NULL;
+
+	l = expr->binop.left;
+	r = expr->binop.right;
+
+	if (l->type == TYPE_MAP && !strcmp(l->string, lval->string) &&
+	    node_same_pure(l->map.rec, lval->map.rec))
+		return r;
+
+	if (r->type == TYPE_MAP && !strcmp(r->string, lval->string) &&
+	    node_same_pure(r->map.rec, lval->map.rec))
+		return l;
+
+	return NULL;
+}
+
 int emit_map_load(prog_t *prog, node_t *n)
 {
-	sym_t *s = sym_from_node(n);
+	node_t *expr = n->parent;
 
 	/* when overriding the current value, there is no need to load
 	 * any previous value */
@@ -545,9 +755,22 @@ int emit_map_load(prog_t *prog, node_t *n)
 	    n->parent->assign.lval == n)
 		return 0;
 
+	/* nor when a method updates the value in place */
+	if (n->parent->type == TYPE_METHOD &&
+	    n->parent->method.map == n &&
+	    n->parent->method.call->dyn->call.inplace)
+		return 0;
+
+	/* nor when it is the @a[k] in @a[k] = @a[k] + x */
+	if (expr->type == TYPE_BINOP && expr->parent->type == TYPE_ASSIGN &&
+	    expr->parent->assign.expr == expr &&
+	    assign_xadd_operand(expr->parent) &&
+	    assign_xadd_operand(expr->parent) != n)
+		return 0;
+
 	emit_stack_zero(prog, n);
 
-	emit_map_lookup_raw(prog, s->map->fd, n->map.rec->dyn->addr);
+	emit_map_lookup_raw(prog, n, n->map.rec->dyn->addr);
 
 	/* if we get a null pointer, skip copy */
 	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 5));
@@ -597,6 +820,12 @@ int emit_binop(prog_t *prog, node_t *binop)
 	const dyn_t *dst, *operand;
 	int imm = 0;
 
+	/* the sum is never materialized, see emit_assign */
+	if (binop->parent->type == TYPE_ASSIGN &&
+	    binop->parent->assign.expr == binop &&
+	    assign_xadd_operand(binop->parent))
+		return 0;
+
 	if (binop->dyn->loc == LOC_REG)
 		dst = &dyn_reg[binop->dyn->reg];
 	else
@@ -640,21 +869,38 @@ int emit_binop(prog_t *prog, node_t *binop)
 int emit_assign(prog_t *prog, node_t *assign)
 {
 	node_t *lval = assign->assign.lval, *expr = assign->assign.expr;
-	sym_t *s = sym_from_node(lval);
+	node_t *operand;
 	int err;
 
 	if (lval->type == TYPE_MAP && !expr) {
-		emit_map_delete_raw(prog, s->map->fd,
-				    lval->map.rec->dyn->addr);
+		emit_map_delete_raw(prog, lval, lval->map.rec->dyn->addr);
 		return 0;
 	}
-	
+
+	/* add the operand through the pointer returned by lookup
+	 * instead of loading, adding and storing the value. */
+	operand = assign_xadd_operand(assign);
+	if (operand) {
+		dyn_t to = {
+			.type = TYPE_INT,
+			.size = sizeof(int64_t),
+			.loc  = LOC_STACK,
+			.addr = lval->dyn->addr,
+		};
+
+		err = emit_xfer_dyn(prog, &to, operand);
+		if (err)
+			return err;
+
+		return emit_map_xadd(prog, lval);
+	}
+
 	err = emit_xfer(prog, lval, expr);
 	if (err)
 		return err;
 
 	if (lval->type == TYPE_MAP)
-		emit_map_update_raw(prog, s->map->fd, lval->map.rec->dyn->addr,
+		emit_map_update_raw(prog, lval, lval->map.rec->dyn->addr,
 				    lval->dyn->addr);
 	return 0;
 }
@@ -662,9 +908,11 @@ int emit_assign(prog_t *prog, node_t *assign)
 int emit_method(prog_t *prog, node_t *method)
 {
 	node_t *map = method->method.map;
-	sym_t *s = sym_from_node(map);
 
-	emit_map_update_raw(prog, s->map->fd, map->map.rec->dyn->addr,
+	if (method->method.call->dyn->call.inplace)
+		return 0;
+
+	emit_map_update_raw(prog, map, map->map.rec->dyn->addr,
 			    map->dyn->addr);
 	return 0;
 }
@@ -17,7 +17,11 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <poll.h>
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -25,8 +29,46 @@
 #include <ply/evpipe.h>
 #include <ply/ply.h>
 
+#include <fcntl.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include <time.h>
+
+/* epoll tags of the non-queue sources, queues are tagged with their
+ * index. */
+#define EVP_SIG     0xffffff00
+#define EVP_TIMEOUT 0xffffff01
+#define EVP_FLUSH   0xffffff02
+#define EVP_STOP    0xffffff03
+#define EVP_RING    0xffffff04
+#define EVP_STATS   0xffffff05
+#define EVP_TICK    0xffffff06
+#define EVP_SWEEP   0xffffff07
+
+/* PERF_RECORD_SAMPLE of a PERF_SAMPLE_RAW event, wrapping an event_t */
+struct perf_sample {
+	struct perf_event_header hdr;
+	uint32_t size;
+	uint8_t  data[0];
+} __attribute__((packed));
+
+/* same, with PERF_SAMPLE_TIME, used in ordered mode */
+struct perf_sample_time {
+	struct perf_event_header hdr;
+	uint64_t time;
+	uint32_t size;
+	uint8_t  data[0];
+} __attribute__((packed));
+
+static uint64_t sample_type = PERF_SAMPLE_RAW;
 
 struct lost_event {
 	struct perf_event_header hdr;
@@ -34,48 +76,235 @@ struct lost_event {
 	uint64_t lost;
 };
 
+/* a recording is this header followed by the raw records of the
+ * backend, in the order they were drained from each queue. */
+#define EVREC_MAGIC   "plyrec\0\0"
+#define EVREC_VERSION 3
+
+#define EVREC_PERF    0
+#define EVREC_RINGBUF 1
+
+struct evrec_hdr {
+	char     magic[8];
+	uint32_t version;
+	uint32_t backend;
+	uint64_t sample_type;
+
+	/* identifies the script's event handlers */
+	uint32_t nhandlers;
+	uint32_t handlers_hash;
+};
+
+/* throughput of a queue, or the ringbuf. each one is only updated by
+ * the thread draining it. readers on other threads may see slightly
+ * stale values, which is fine for statistics. times are only tracked
+ * when statistics are enabled. */
+struct evstats {
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t lost;
+	uint64_t wakeups;
+	uint64_t drain_ns;
+	uint64_t handler_ns;
+};
+
+/* upper bound for automatically sized queues */
+#define EVQUEUE_AUTO_MAX (1 << 20)
+
 struct evqueue {
+	evpipe_t *evp;
+	uint32_t  cpu;
+
+	int epfd;
 	int fd;
 	struct perf_event_mmap_page *mem;
+	size_t size;
 
 	void *buf;
+
+	struct evstats st;
+	int grow;
+
+	/* flight mode, head at the time of the last snapshot */
+	uint64_t snap;
+
+	/* ordered mode, oldest sample not yet output and its time */
+	struct perf_event_header *next;
+	uint64_t next_time;
 };
 
-TAILQ_HEAD(evhandlers, evhandler);
-static struct evhandlers evh_list = TAILQ_HEAD_INITIALIZER(evh_list);
-static uint64_t next_type = 0;
+/* ordered mode, queues with a pending sample in a min-heap keyed on
+ * the time of that sample. */
+struct evorder {
+	uint64_t window;
 
-static evhandler_t *evhandler_find(uint64_t type)
-{
-	evhandler_t *evh;
+	uint32_t len;
+	struct evqueue **heap;
+};
 
-	TAILQ_FOREACH(evh, &evh_list, node) {
-		if (evh->type == type)
-			return evh;
-	}
+/* async mode, events are copied to a single-producer single-consumer
+ * queue as soon as they are drained, releasing the kernel's queue
+ * space. a writer thread formats and outputs them, so slow output
+ * only stalls the kernel once this queue is full as well. */
+struct evwriter {
+	pthread_t thread;
 
-	return NULL;
+	uint8_t *buf;
+	size_t   size;
+
+	/* head is only written by the loop, tail only by the writer */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+
+	/* set by the side that is about to sleep on its eventfd */
+	int idle __attribute__((aligned(64)));
+	int full;
+	int stop;
+
+	int kickfd;
+	int spacefd;
+
+	int    err;
+	FILE  *out;
+	char  *obuf;
+	size_t olen;
+};
+
+/* a len of zero means that the rest of the buffer is unused, entries
+ * are never split across the end. */
+struct evwriter_ent {
+	uint32_t len;
+	uint32_t size;
+	uint8_t  data[0];
+};
+
+/* largest power of two the kernel accepts as ringbuf size */
+#define EVRING_SIZE_MAX (512UL << 20)
+
+/* shared BPF_MAP_TYPE_RINGBUF, used instead of the per-cpu queues
+ * when available and asked for. */
+struct evring {
+	int fd;
+
+	unsigned long *cons;
+	unsigned long *prod;
+	uint8_t *data;
+	size_t size;
+
+	/* probes count the events they could not fit, per cpu, in an
+	 * array that is mapped here. */
+	int ncpus;
+	uint64_t *lost;
+	uint64_t *seen;
+
+	struct evstats st;
+};
+
+struct evworker {
+	pthread_t thread;
+	evpipe_t *evp;
+
+	int id;
+	int epfd;
+	int flushfd;
+	int err;
+
+	/* events are formatted to a private stream and then written to
+	 * stdout in one go, a partial line is held back until it is
+	 * completed by a later event. */
+	FILE  *out;
+	char  *buf;
+	size_t len;
+
+	char  *carry;
+	size_t carry_len;
+};
+
+/* type ids are handed out sequentially, so they double as an index
+ * into the handler table. */
+static evhandler_t **evh_table;
+static uint32_t      evh_cap;
+static uint32_t      next_type;
+
+static inline evhandler_t *evhandler_find(uint32_t type)
+{
+	return (type < next_type) ? evh_table[type] : NULL;
 }
 
 void evhandler_register(evhandler_t *evh)
 {
+	if (next_type == evh_cap) {
+		evh_cap = evh_cap ? (evh_cap << 1) : 16;
+		evh_table = realloc(evh_table, evh_cap * sizeof(*evh_table));
+		assert(evh_table);
+	}
+
 	evh->type = next_type++;
-	TAILQ_INSERT_TAIL(&evh_list, evh, node);
+	evh_table[evh->type] = evh;
+}
+
+/* fnv-1a over the descriptions of all handlers, in type order */
+static uint32_t evhandler_hash(void)
+{
+	uint32_t hash = 2166136261u, type;
+	const char *c;
+
+	for (type = 0; type < next_type; type++) {
+		for (c = evh_table[type]->desc ? : ""; ; c++) {
+			hash = (hash ^ (uint8_t)*c) * 16777619u;
+			if (!*c)
+				break;
+		}
+	}
+
+	return hash;
 }
 
 
-static int event_handle(event_t *ev, size_t size)
+static struct evwriter *writer;
+static int evwriter_push(struct evwriter *w, event_t *ev, size_t size);
+
+static int event_call(FILE *fp, event_t *ev, size_t size)
 {
 	evhandler_t *evh;
 
 	evh = evhandler_find(ev->type);
 	if (!evh) {
-		_e("unknown event: type:%#"PRIx64" size:%#zx\n",
+		_e("unknown event: type:%#"PRIx32" size:%#zx\n",
 		   ev->type, size);
 		return -ENOSYS;
 	}
 
-	return evh->handle(ev, evh->priv);
+	return evh->handle(fp, ev, size, evh->priv);
+}
+
+static inline uint64_t evstats_ns(void)
+{
+	struct timespec ts;
+
+	if (!G.stats)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int event_handle(FILE *fp, event_t *ev, size_t size,
+			struct evstats *st)
+{
+	uint64_t start = evstats_ns();
+	int err;
+
+	st->records++;
+
+	if (writer)
+		err = evwriter_push(writer, ev, size);
+	else
+		err = event_call(fp, ev, size);
+
+	if (G.stats)
+		st->handler_ns += evstats_ns() - start;
+	return err;
 }
 
 static inline uint64_t __get_head(struct perf_event_mmap_page *mem)
@@ -93,153 +322,1878 @@ static inline void __set_tail(struct perf_event_mmap_page *mem, uint64_t tail)
 	mem->data_tail = tail;
 }
 
-int evqueue_drain(struct evqueue *q, int strict)
+static int event_dispatch(FILE *fp, struct perf_event_header *rec,
+			  int strict, struct evstats *st)
 {
+	struct perf_sample_time *tsample;
+	struct perf_sample *sample;
 	struct lost_event *lost;
-	uint64_t size, offs, head, tail;
-	uint8_t *base, *this, *next;
-	event_t *ev;
-	int err = 0;
-
-	size = q->mem->data_size;
-	offs = q->mem->data_offset;
-	base = (uint8_t *)q->mem + offs;
+	size_t size;
 
-	for (head = __get_head(q->mem); q->mem->data_tail != head;
-	     __set_tail(q->mem, q->mem->data_tail + ev->hdr.size)) {
-		tail = q->mem->data_tail;
+	switch (rec->type) {
+	case PERF_RECORD_SAMPLE:
+		st->bytes += rec->size;
 
-		this = base + (tail % size);
-		ev   = (void *)this;
-		next = base + ((tail + ev->hdr.size) % size);
+		if (sample_type & PERF_SAMPLE_TIME) {
+			tsample = (void *)rec;
+			if (rec->size < sizeof(*tsample))
+				goto malformed;
 
-		if (next < this) {
-			size_t left = (base + size) - this;
+			size = tsample->size;
+			if (size < sizeof(event_t) ||
+			    size > rec->size - sizeof(*tsample))
+				goto malformed;
 
-			q->buf = realloc(q->buf, ev->hdr.size);
-			memcpy(q->buf, this, left);
-			memcpy(q->buf + left, base, ev->hdr.size - left);
-			ev = q->buf;
+			return event_handle(fp, (void *)tsample->data, size, st);
 		}
 
-		switch (ev->hdr.type) {
-		case PERF_RECORD_SAMPLE:
-			err = event_handle(ev, ev->hdr.size);
-			break;
+		sample = (void *)rec;
+		if (rec->size < sizeof(*sample))
+			goto malformed;
 
-		case PERF_RECORD_LOST:
-			lost = (void *)ev;
+		size = sample->size;
+		if (size < sizeof(event_t) || size > rec->size - sizeof(*sample))
+			goto malformed;
 
-			if (strict) {
-				_e("lost %"PRId64" events", lost->lost);
-				err = -EOVERFLOW;
-			} else {
-				_w("lost %"PRId64" events", lost->lost);
-			}
-			break;
+		return event_handle(fp, (void *)sample->data, size, st);
 
-		default:
-			_e("unknown perf event %#"PRIx32, ev->hdr.type);
-			err = -EINVAL;
-			break;
+	case PERF_RECORD_LOST:
+		if (rec->size < sizeof(*lost))
+			goto malformed;
+
+		lost = (void *)rec;
+		st->lost += lost->lost;
+
+		if (strict) {
+			_e("lost %"PRId64" events", lost->lost);
+			return -EOVERFLOW;
 		}
 
+		_w("lost %"PRId64" events", lost->lost);
+		return 0;
+	}
+
+	_e("unknown perf event %#"PRIx32, rec->type);
+	return -EINVAL;
+
+malformed:
+	_e("malformed perf event, type:%#"PRIx32" size:%#"PRIx16,
+	   rec->type, rec->size);
+	return -EINVAL;
+}
+
+static int evqueue_grow(struct evqueue *q, FILE *fp, int strict);
+
+static int evqueue_record(struct evqueue *q)
+{
+	uint64_t size, head, tail;
+	struct iovec iov[2];
+	uint8_t *base;
+	ssize_t len;
+	int iovcnt = 1;
+
+	size = q->mem->data_size;
+	base = (uint8_t *)q->mem + q->mem->data_offset;
+
+	head = __get_head(q->mem);
+	tail = q->mem->data_tail;
+	if (head == tail)
+		return 0;
+
+	/* write everything that is available straight from the ring,
+	 * in at most two chunks if it wraps. */
+	iov[0].iov_base = base + (tail & (size - 1));
+	iov[0].iov_len  = head - tail;
+	if ((tail & (size - 1)) + (head - tail) > size) {
+		iov[0].iov_len  = size - (tail & (size - 1));
+		iov[1].iov_base = base;
+		iov[1].iov_len  = (head - tail) - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	len = writev(q->evp->recfd, iov, iovcnt);
+	if (len < 0) {
+		_eno("could not write recording");
+		return -errno;
+	} else if (len != head - tail) {
+		_e("short write to recording");
+		return -EIO;
+	}
+
+	q->st.bytes += head - tail;
+	__set_tail(q->mem, head);
+	return 0;
+}
+
+static struct perf_event_header *evqueue_tail(struct evqueue *q)
+{
+	struct perf_event_header *rec;
+	uint64_t size, tail;
+	uint8_t *base;
+
+	size = q->mem->data_size;
+	base = (uint8_t *)q->mem + q->mem->data_offset;
+	tail = q->mem->data_tail & (size - 1);
+	rec  = (void *)(base + tail);
+
+	/* records are 8-byte aligned, so the header itself never
+	 * wraps. the payload might though, in which case it is
+	 * reassembled in the queue's bounce buffer. */
+	if (tail + rec->size > size) {
+		size_t left = size - tail;
+
+		memcpy(q->buf, rec, left);
+		memcpy(q->buf + left, base, rec->size - left);
+		rec = q->buf;
+	}
+
+	return rec;
+}
+
+int evqueue_drain(struct evqueue *q, FILE *fp, int strict)
+{
+	struct perf_event_header *rec;
+	uint64_t size, head, start;
+	int err = 0;
+
+	start = evstats_ns();
+
+	size = q->mem->data_size;
+	head = __get_head(q->mem);
+
+	/* a queue that is more than 3/4 full when we get to it is not
+	 * keeping up with the event rate. */
+	if (G.bufauto && !q->grow &&
+	    (head - q->mem->data_tail) > ((size >> 1) + (size >> 2)))
+		q->grow = 1;
+
+	if (G.record) {
+		err = evqueue_record(q);
+		goto out;
+	}
+
+	for (; q->mem->data_tail != head;
+	     __set_tail(q->mem, q->mem->data_tail + rec->size)) {
+		rec = evqueue_tail(q);
+
+		err = event_dispatch(fp, rec, strict, &q->st);
 		if (err)
 			break;
+
+		if (G.bufauto && !q->grow && rec->type == PERF_RECORD_LOST)
+			q->grow = 1;
 	}
 
+out:
+	if (G.stats)
+		q->st.drain_ns += evstats_ns() - start;
+
+	if (!err && q->grow > 0)
+		err = evqueue_grow(q, fp, strict);
+
 	return err;
 }
 
-int evqueue_init(evpipe_t *evp, uint32_t cpu, size_t size)
+static int evqueue_open(struct evqueue *q, size_t size,
+			int *fd, struct perf_event_mmap_page **mem)
 {
 	struct perf_event_attr attr = { 0 };
-	struct evqueue *q = &evp->q[cpu];
-	int err;
 
 	attr.type          = PERF_TYPE_SOFTWARE;
 	attr.config        = PERF_COUNT_SW_BPF_OUTPUT;
 	attr.sample_type   = PERF_SAMPLE_RAW;
-	attr.wakeup_events = 1;
 
-	q->fd = perf_event_open(&attr, -1, cpu, -1, 0);
-	if (q->fd < 0) {
+	if (G.wakeup_bytes) {
+		attr.watermark        = 1;
+		attr.wakeup_watermark = G.wakeup_bytes;
+	} else {
+		attr.wakeup_events = G.wakeup_events;
+	}
+
+	/* stamp samples with the same clock that is used to decide
+	 * when they are old enough to be output in order. */
+	attr.sample_type = sample_type;
+	if (sample_type & PERF_SAMPLE_TIME) {
+		attr.use_clockid = 1;
+		attr.clockid     = CLOCK_MONOTONIC;
+	}
+
+#ifdef LINUX_HAS_WRITE_BACKWARD
+	/* in flight mode the kernel overwrites the oldest events
+	 * instead of dropping new ones, and we never drain. */
+	attr.write_backward = G.flight;
+#endif
+
+	*fd = perf_event_open(&attr, -1, q->cpu, -1, 0);
+	if (*fd < 0) {
 		_eno("could not create queue");
-		return q->fd;
+		return *fd;
+	}
+
+	/* a read-only mapping means that we never update data_tail,
+	 * i.e. that the queue may be overwritten. */
+	size += sysconf(_SC_PAGESIZE);
+	*mem = mmap(NULL, size, PROT_READ | (G.flight ? 0 : PROT_WRITE),
+		    MAP_SHARED, *fd, 0);
+	if (*mem == MAP_FAILED) {
+		_eno("could not mmap queue");
+		close(*fd);
+		return -1;
 	}
 
-	err = bpf_map_update(evp->mapfd, &cpu, &q->fd, BPF_ANY);
+	return 0;
+}
+
+static int evqueue_link(struct evqueue *q, int fd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = q - q->evp->q,
+	};
+	int err;
+
+	err = bpf_map_update(q->evp->mapfd, &q->cpu, &fd, BPF_ANY);
 	if (err) {
 		_eno("could not link map to queue");
 		return err;
 	}
 
-	size += sysconf(_SC_PAGESIZE);
-	q->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
-	if (q->mem == MAP_FAILED) {
-		_eno("could not mmap queue");
-		return -1;
+	/* flight mode queues are only read on demand */
+	if (G.flight)
+		return 0;
+
+	err = epoll_ctl(q->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (err) {
+		_eno("could not poll queue");
+		return err;
 	}
 
-	evp->poll[cpu].fd     = q->fd;
-	evp->poll[cpu].events = POLLIN;
 	return 0;
 }
 
-int evpipe_loop(evpipe_t *evp, int *sig, int strict)
+static void evqueue_bounce_alloc(struct evqueue *q)
 {
-	int cpu, err, ready;
+	/* the perf mmap ABI requires the control page to immediately
+	 * precede the data pages, and only allows the buffer to be
+	 * mapped from offset zero. so there is no way of mapping the
+	 * data pages twice back to back, which would have made every
+	 * record contiguous. instead, allocate a bounce buffer large
+	 * enough to hold any record up front, keeping allocations out
+	 * of the drain path. */
+	q->buf = realloc(q->buf, q->size < 0x10000 ? q->size : 0x10000);
+	assert(q->buf);
+}
 
-	for (;!(*sig);) {
-		ready = poll(evp->poll, evp->ncpus, -1);
-		if (ready <= 0)
-			return ready ? : 0;
+static int evqueue_grow(struct evqueue *q, FILE *fp, int strict)
+{
+	struct perf_event_mmap_page *mem, *old_mem = q->mem;
+	int err, fd, old_fd = q->fd;
+	size_t size = q->size << 1;
 
-		for (cpu = 0; ready && (cpu < evp->ncpus); cpu++) {
-			if (!(evp->poll[cpu].revents & POLLIN))
-				continue;
+	if (size > EVQUEUE_AUTO_MAX) {
+		q->grow = 0;
+		return 0;
+	}
 
-			err = evqueue_drain(&evp->q[cpu], strict);
-			if (err)
-				return err;
+	/* keep the final drain of the old queue from recursing back
+	 * in here */
+	q->grow = -1;
 
-			ready--;
-		}
+	err = evqueue_open(q, size, &fd, &mem);
+	if (err) {
+		_w("cpu%u: unable to grow queue, staying at %zu bytes",
+		   q->cpu, q->size);
+		q->grow = 0;
+		return 0;
 	}
 
-	return 0;
+	/* from here on, the kernel outputs to the new queue. anything
+	 * that made it to the old one before the switch is drained
+	 * before it is released. */
+	err = evqueue_link(q, fd);
+	if (err)
+		return err;
+
+	epoll_ctl(q->epfd, EPOLL_CTL_DEL, old_fd, NULL);
+	err = evqueue_drain(q, fp, strict);
+
+	munmap(old_mem, q->size + sysconf(_SC_PAGESIZE));
+	close(old_fd);
+
+	_d("cpu%u: queue grown to %zu bytes", q->cpu, size);
+	q->fd   = fd;
+	q->mem  = mem;
+	q->size = size;
+	q->grow = 0;
+	evqueue_bounce_alloc(q);
+	return err;
 }
 
-int evpipe_init(evpipe_t *evp, size_t qsize)
+int evqueue_init(evpipe_t *evp, struct evqueue *q, size_t size)
 {
-	uint32_t cpu;
 	int err;
 
-	if (G.dump) {
-		evp->mapfd = 0xeeee;
-		return 0;
+	q->evp  = evp;
+	q->size = size;
+
+	/* with workers, each queue is polled by its owner */
+	if (evp->nworkers)
+		q->epfd = evp->w[(q - evp->q) % evp->nworkers].epfd;
+	else
+		q->epfd = evp->epfd;
+
+	err = evqueue_open(q, size, &q->fd, &q->mem);
+	if (err)
+		return err;
+
+	evqueue_bounce_alloc(q);
+	return evqueue_link(q, q->fd);
+}
+
+static void evorder_push(struct evorder *o, struct evqueue *q)
+{
+	uint32_t i, parent;
+
+	for (i = o->len++; i; i = parent) {
+		parent = (i - 1) >> 1;
+		if (o->heap[parent]->next_time <= q->next_time)
+			break;
+
+		o->heap[i] = o->heap[parent];
 	}
 
-	evp->ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	o->heap[i] = q;
+}
 
-	evp->mapfd = bpf_map_create(BPF_MAP_TYPE_PERF_EVENT_ARRAY,
-				    sizeof(uint32_t), sizeof(int), evp->ncpus);
-	if (evp->mapfd < 0) {
-		_eno("could not create map");
-		return evp->mapfd;
+static void evorder_pop(struct evorder *o)
+{
+	struct evqueue *q = o->heap[--o->len];
+	uint32_t i, child;
+
+	for (i = 0; (child = (i << 1) + 1) < o->len; i = child) {
+		if (child + 1 < o->len &&
+		    o->heap[child + 1]->next_time < o->heap[child]->next_time)
+			child++;
+
+		if (q->next_time <= o->heap[child]->next_time)
+			break;
+
+		o->heap[i] = o->heap[child];
 	}
 
-	evp->q = calloc(evp->ncpus, sizeof(*evp->q));
-	assert(evp->q);
+	o->heap[i] = q;
+}
+
+/* make the oldest sample of an idle queue pending, records without a
+ * timestamp are output straight away. */
+static int evorder_fill(struct evorder *o, struct evqueue *q, int strict)
+{
+	struct perf_event_header *rec;
+	int err;
+
+	while (q->mem->data_tail != __get_head(q->mem)) {
+		rec = evqueue_tail(q);
+
+		if (rec->type == PERF_RECORD_SAMPLE) {
+			q->next = rec;
+			q->next_time = ((struct perf_sample_time *)rec)->time;
+			evorder_push(o, q);
+			return 0;
+		}
+
+		err = event_dispatch(stdout, rec, strict, &q->st);
+		__set_tail(q->mem, q->mem->data_tail + rec->size);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* output pending samples in time order. the oldest one is known to be
+ * next once every queue has one pending. until then, it is assumed
+ * that nothing older will show up once it is older than the window.
+ * when forced, or when a queue is close to overflowing, everything
+ * is output right away. */
+static int evorder_drain(evpipe_t *evp, int strict, int force)
+{
+	struct evorder *o = evp->order;
+	struct evqueue *q;
+	struct timespec ts;
+	uint64_t deadline, size;
+	uint32_t i;
+	int err = 0;
+
+	for (i = 0; i < evp->nqueues; i++) {
+		q = &evp->q[i];
+
+		size = q->mem->data_size;
+		if (__get_head(q->mem) - q->mem->data_tail >
+		    ((size >> 1) + (size >> 2))) {
+			_d("cpu%u: queue is filling up, flushing", q->cpu);
+			force = 1;
+		}
+
+		if (!q->next) {
+			err = evorder_fill(o, q, strict);
+			if (err)
+				return err;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	deadline = ts.tv_sec * 1000000000ULL + ts.tv_nsec - o->window;
+
+	while (o->len) {
+		q = o->heap[0];
+		if (!force && o->len < evp->nqueues && q->next_time > deadline)
+			break;
+
+		evorder_pop(o);
 
-	evp->poll = calloc(evp->ncpus, sizeof(*evp->poll));
-	assert(evp->poll);
+		err = event_dispatch(stdout, q->next, strict, &q->st);
+		__set_tail(q->mem, q->mem->data_tail + q->next->size);
+		q->next = NULL;
+		if (err)
+			return err;
 
-	for (cpu = 0; cpu < evp->ncpus; cpu++) {
-		err = evqueue_init(evp, cpu, qsize);
+		err = evorder_fill(o, q, strict);
 		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int evorder_init(evpipe_t *evp)
+{
+	struct evorder *o;
+
+	o = calloc(1, sizeof(*o));
+	assert(o);
+
+	o->window = G.order * 1000000ULL;
+	o->heap = calloc(evp->nqueues, sizeof(*o->heap));
+	assert(o->heap);
+
+	evp->order = o;
+	return 0;
+}
+
+static int evqueue_emit(struct evqueue *q, FILE *fp,
+			struct perf_event_header *rec, int strict)
+{
+	if (!G.record)
+		return event_dispatch(fp, rec, strict, &q->st);
+
+	if (write(q->evp->recfd, rec, rec->size) != rec->size) {
+		_eno("could not write recording");
+		return -EIO;
+	}
+
+	q->st.bytes += rec->size;
+	return 0;
+}
+
+#ifdef LINUX_HAS_WRITE_BACKWARD
+static int evqueue_snapshot(struct evqueue *q, FILE *fp, int strict)
+{
+	struct perf_event_header *rec;
+	uint64_t size, head, pos, *recs, start;
+	uint8_t *base;
+	size_t n = 0;
+	int err = 0;
+
+	start = evstats_ns();
+	size = q->mem->data_size;
+	base = (uint8_t *)q->mem + q->mem->data_offset;
+
+	if (ioctl(q->fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 1)) {
+		_eno("cpu%u: could not pause queue", q->cpu);
+		return -errno;
+	}
+
+	recs = malloc((size / sizeof(*rec)) * sizeof(*recs));
+	assert(recs);
+
+	/* the head points to the newest record and older ones follow
+	 * it. walk towards the oldest one that is still intact, or
+	 * the newest one from the previous snapshot. */
+	head = __get_head(q->mem);
+	for (pos = head; pos != q->snap; pos += rec->size) {
+		rec = (void *)(base + (pos & (size - 1)));
+		if (!rec->size || (pos - head) + rec->size > size)
 			break;
+
+		recs[n++] = pos;
+	}
+	q->snap = head;
+
+	/* output them in the order they were written */
+	while (!err && n--) {
+		pos = recs[n] & (size - 1);
+		rec = (void *)(base + pos);
+
+		if (pos + rec->size > size) {
+			memcpy(q->buf, rec, size - pos);
+			memcpy(q->buf + (size - pos), base,
+			       rec->size - (size - pos));
+			rec = q->buf;
+		}
+
+		err = evqueue_emit(q, fp, rec, strict);
 	}
 
+	free(recs);
+
+	if (G.stats)
+		q->st.drain_ns += evstats_ns() - start;
+
+	if (ioctl(q->fd, PERF_EVENT_IOC_PAUSE_OUTPUT, 0)) {
+		_eno("cpu%u: could not resume queue", q->cpu);
+		return err ? : -errno;
+	}
+
+	return err;
+}
+#else
+static int evqueue_snapshot(struct evqueue *q, FILE *fp, int strict)
+{
+	return -ENOSYS;
+}
+#endif
+
+static int evpipe_snapshot(evpipe_t *evp, int strict)
+{
+	uint32_t i;
+	int err;
+
+	for (i = 0; i < evp->nqueues; i++) {
+		err = evqueue_snapshot(&evp->q[i], stdout, strict);
+		if (err)
+			return err;
+	}
+
+	fflush(stdout);
+	return 0;
+}
+
+#ifdef LINUX_HAS_RINGBUF
+static inline size_t evring_rec_size(uint32_t len)
+{
+	len &= ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+	return (len + BPF_RINGBUF_HDR_SZ + 7) & ~7;
+}
+
+static int evring_record(evpipe_t *evp, unsigned long cons, unsigned long end)
+{
+	struct evring *rb = evp->rb;
+	ssize_t len;
+
+	/* the data pages are mapped twice in a row, so any span of
+	 * records is contiguous in memory and can be written in one
+	 * go. */
+	len = write(evp->recfd, rb->data + (cons & (rb->size - 1)), end - cons);
+	if (len < 0) {
+		_eno("could not write recording");
+		return -errno;
+	} else if (len != end - cons) {
+		_e("short write to recording");
+		return -EIO;
+	}
+
+	rb->st.bytes += len;
+	return 0;
+}
+
+/* the ringbuf has no equivalent of PERF_RECORD_LOST, report drops
+ * in the same way from the probes' counters instead. */
+static int evring_lost(evpipe_t *evp)
+{
+	struct evring *rb = evp->rb;
+	uint64_t lost = 0, n;
+	int cpu;
+
+	for (cpu = 0; cpu < rb->ncpus; cpu++) {
+		n = __atomic_load_n(&rb->lost[cpu], __ATOMIC_RELAXED);
+		lost += n - rb->seen[cpu];
+		rb->seen[cpu] = n;
+	}
+
+	if (!lost)
+		return 0;
+
+	rb->st.lost += lost;
+
+	if (evp->strict) {
+		_e("lost %"PRIu64" events", lost);
+		return -EOVERFLOW;
+	}
+
+	_w("lost %"PRIu64" events", lost);
+	return 0;
+}
+
+static int evring_drain(evpipe_t *evp, FILE *fp)
+{
+	struct evring *rb = evp->rb;
+	unsigned long cons, prod, end;
+	uint64_t start;
+	uint32_t len;
+	uint8_t *rec;
+	int err;
+
+	err = evring_lost(evp);
+	if (err)
+		return err;
+
+	start = evstats_ns();
+	cons = *rb->cons;
+	prod = __atomic_load_n(rb->prod, __ATOMIC_ACQUIRE);
+
+	/* find the last record that is committed, a busy one blocks
+	 * everything after it. */
+	for (end = cons; end < prod; end += evring_rec_size(len)) {
+		len = __atomic_load_n((uint32_t *)(rb->data + (end & (rb->size - 1))),
+				      __ATOMIC_ACQUIRE);
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+	}
+
+	if (end == cons)
+		return 0;
+
+	if (G.record) {
+		err = evring_record(evp, cons, end);
+		cons = end;
+		goto out;
+	}
+
+	for (; !err && cons < end; cons += evring_rec_size(len)) {
+		rec = rb->data + (cons & (rb->size - 1));
+		len = *(uint32_t *)rec;
+
+		rb->st.bytes += evring_rec_size(len);
+		if (len & BPF_RINGBUF_DISCARD_BIT)
+			continue;
+
+		err = event_handle(fp, (void *)(rec + BPF_RINGBUF_HDR_SZ), len,
+				   &rb->st);
+	}
+
+out:
+	__atomic_store_n(rb->cons, cons, __ATOMIC_RELEASE);
+
+	if (G.stats)
+		rb->st.drain_ns += evstats_ns() - start;
+	return err;
+}
+
+static int evring_lost_init(evpipe_t *evp)
+{
+	struct evring *rb = evp->rb;
+	long pagesz = sysconf(_SC_PAGESIZE);
+	size_t size;
+
+	rb->ncpus = cpus_possible();
+	rb->seen = calloc(rb->ncpus, sizeof(*rb->seen));
+	assert(rb->seen);
+
+	evp->lostfd = bpf_map_create_flags(BPF_MAP_TYPE_ARRAY,
+					   sizeof(uint32_t), sizeof(uint64_t),
+					   rb->ncpus, BPF_F_MMAPABLE);
+	if (evp->lostfd < 0) {
+		_eno("could not create ringbuf loss counters");
+		return evp->lostfd;
+	}
+
+	size = (rb->ncpus * sizeof(uint64_t) + pagesz - 1) & ~(pagesz - 1);
+	rb->lost = mmap(NULL, size, PROT_READ, MAP_SHARED, evp->lostfd, 0);
+	if (rb->lost == MAP_FAILED) {
+		_eno("could not mmap ringbuf loss counters");
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int evring_init(evpipe_t *evp, size_t size)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EVP_RING };
+	long pagesz = sysconf(_SC_PAGESIZE);
+	struct evring *rb;
+	void *prod;
+	int err;
+
+	rb = calloc(1, sizeof(*rb));
+	assert(rb);
+	rb->size = size;
+	evp->rb = rb;
+
+	err = evring_lost_init(evp);
+	if (err)
+		return err;
+
+	rb->fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, 0, 0, size);
+	if (rb->fd < 0) {
+		_eno("could not create ringbuf");
+		return rb->fd;
+	}
+	evp->mapfd = rb->fd;
+
+	rb->cons = mmap(NULL, pagesz, PROT_READ | PROT_WRITE, MAP_SHARED,
+			rb->fd, 0);
+	if (rb->cons == MAP_FAILED) {
+		_eno("could not mmap ringbuf consumer page");
+		return -errno;
+	}
+
+	prod = mmap(NULL, pagesz + 2 * size, PROT_READ, MAP_SHARED,
+		    rb->fd, pagesz);
+	if (prod == MAP_FAILED) {
+		_eno("could not mmap ringbuf");
+		return -errno;
+	}
+	rb->prod = prod;
+	rb->data = prod + pagesz;
+
+	if (epoll_ctl(evp->epfd, EPOLL_CTL_ADD, rb->fd, &ev)) {
+		_eno("could not poll ringbuf");
+		return -errno;
+	}
+
+	return 0;
+}
+#else
+static int evring_drain(evpipe_t *evp, FILE *fp)
+{
+	return -ENOSYS;
+}
+
+static int evring_init(evpipe_t *evp, size_t size)
+{
+	_e("ringbuf backend requires linux 5.8 or later");
+	return -ENOSYS;
+}
+#endif
+
+static int evpipe_flush(evpipe_t *evp, int strict)
+{
+	uint32_t i;
+	int err;
+
+	if (G.flight)
+		return evpipe_snapshot(evp, strict);
+
+	if (evp->order) {
+		err = evorder_drain(evp, strict, 0);
+		fflush(stdout);
+		return err;
+	}
+
+	if (evp->rb) {
+		err = evring_drain(evp, stdout);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < evp->nqueues; i++) {
+		err = evqueue_drain(&evp->q[i], stdout, strict);
+		if (err)
+			return err;
+	}
+
+	fflush(stdout);
+	return 0;
+}
+
+static int evpipe_timer(int epfd, uint32_t tag, long msecs, int periodic)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = tag };
+	struct itimerspec its = { 0 };
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		_eno("could not create timer");
+		return -errno;
+	}
+
+	its.it_value.tv_sec  = msecs / 1000;
+	its.it_value.tv_nsec = (msecs % 1000) * 1000000;
+	if (periodic)
+		its.it_interval = its.it_value;
+
+	if (timerfd_settime(fd, 0, &its, NULL) ||
+	    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		_eno("could not arm timer");
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+static void evworker_output(struct evworker *w, int all)
+{
+	char *eol;
+	size_t len;
+
+	fflush(w->out);
+
+	if (all) {
+		len = w->len;
+	} else {
+		eol = memrchr(w->buf, '\n', w->len);
+		len = eol ? (eol - w->buf) + 1 : 0;
+	}
+
+	if (len && w->carry_len) {
+		flockfile(stdout);
+		fwrite(w->carry, w->carry_len, 1, stdout);
+		fwrite(w->buf, len, 1, stdout);
+		funlockfile(stdout);
+		w->carry_len = 0;
+	} else if (len) {
+		/* a single fwrite(3) is atomic with respect to the
+		 * other workers. */
+		fwrite(w->buf, len, 1, stdout);
+	} else if (all && w->carry_len) {
+		fwrite(w->carry, w->carry_len, 1, stdout);
+		w->carry_len = 0;
+	}
+
+	if (len < w->len) {
+		w->carry = realloc(w->carry, w->carry_len + w->len - len);
+		assert(w->carry);
+		memcpy(w->carry + w->carry_len, w->buf + len, w->len - len);
+		w->carry_len += w->len - len;
+	}
+
+	rewind(w->out);
+}
+
+static int evworker_drain(struct evworker *w, uint32_t i)
+{
+	int err;
+
+	err = evqueue_drain(&w->evp->q[i], w->out, w->evp->strict);
+	evworker_output(w, 0);
+	return err;
+}
+
+static void *evworker_run(void *_w)
+{
+	struct evworker *w = _w;
+	evpipe_t *evp = w->evp;
+	struct epoll_event evs[16];
+	cpu_set_t cpus;
+	uint64_t expirations;
+	uint32_t q;
+	int i, ready;
+
+	/* run on the cpu of our first queue */
+	CPU_ZERO(&cpus);
+	CPU_SET(evp->q[w->id].cpu, &cpus);
+	if (pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus))
+		_w("worker %d: could not pin to cpu", w->id);
+
+	while (!w->err) {
+		ready = epoll_wait(w->epfd, evs, 16, -1);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+
+			_eno("worker %d: could not wait for events", w->id);
+			w->err = -errno;
+			break;
+		}
+
+		for (i = 0; !w->err && i < ready; i++) {
+			switch (evs[i].data.u32) {
+			case EVP_STOP:
+				goto out;
+			case EVP_FLUSH:
+				/* bound the latency by draining all of
+				 * our queues, busy or not */
+				if (read(w->flushfd, &expirations,
+					 sizeof(expirations)) < 0)
+					continue;
+
+				for (q = w->id; !w->err && q < evp->nqueues;
+				     q += evp->nworkers)
+					w->err = evworker_drain(w, q);
+
+				fflush(stdout);
+				continue;
+			}
+
+			evp->q[evs[i].data.u32].st.wakeups++;
+			w->err = evworker_drain(w, evs[i].data.u32);
+		}
+	}
+
+out:
+	for (q = w->id; !w->err && q < evp->nqueues; q += evp->nworkers)
+		w->err = evworker_drain(w, q);
+
+	evworker_output(w, 1);
+
+	/* if we bailed out on our own, take everyone else down too */
+	if (w->err)
+		eventfd_write(evp->stopfd, 1);
+
+	return NULL;
+}
+
+static int evworkers_stop(evpipe_t *evp)
+{
+	struct evworker *w;
+	int err = 0;
+
+	eventfd_write(evp->stopfd, 1);
+
+	for (w = evp->w; w < &evp->w[evp->nworkers]; w++) {
+		pthread_join(w->thread, NULL);
+		err = err ? : w->err;
+	}
+
+	fflush(stdout);
+	return err;
+}
+
+static int evworkers_start(evpipe_t *evp)
+{
+	struct evworker *w;
+	int err;
+
+	for (w = evp->w; w < &evp->w[evp->nworkers]; w++) {
+		err = pthread_create(&w->thread, NULL, evworker_run, w);
+		if (err) {
+			_e("could not start worker %d: %s", w->id, strerror(err));
+
+			/* reap the ones that did start */
+			evp->nworkers = w - evp->w;
+			evworkers_stop(evp);
+			evp->nworkers = 0;
+			return -err;
+		}
+	}
+
+	return 0;
+}
+
+static int evworkers_init(evpipe_t *evp)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EVP_STOP };
+	struct evworker *w;
+
+	if (evp->nworkers > evp->nqueues)
+		evp->nworkers = evp->nqueues;
+
+	evp->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (evp->stopfd < 0) {
+		_eno("could not create stop event");
+		return -errno;
+	}
+
+	/* the main loop also wants to know if a worker fails */
+	if (epoll_ctl(evp->epfd, EPOLL_CTL_ADD, evp->stopfd, &ev)) {
+		_eno("could not poll stop event");
+		return -errno;
+	}
+
+	evp->w = calloc(evp->nworkers, sizeof(*evp->w));
+	assert(evp->w);
+
+	for (w = evp->w; w < &evp->w[evp->nworkers]; w++) {
+		w->evp = evp;
+		w->id  = w - evp->w;
+
+		w->out = open_memstream(&w->buf, &w->len);
+		assert(w->out);
+
+		w->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (w->epfd < 0 ||
+		    epoll_ctl(w->epfd, EPOLL_CTL_ADD, evp->stopfd, &ev)) {
+			_eno("could not create worker %d", w->id);
+			return -errno;
+		}
+
+		/* with batched wakeups, a quiet queue could hold on to
+		 * its events for as long as the worker's other queues
+		 * keep it busy. each worker sweeps all of its queues
+		 * on a timer of its own. */
+		if (G.wakeup_bytes || G.wakeup_events > 1) {
+			w->flushfd = evpipe_timer(w->epfd, EVP_FLUSH,
+						  G.latency, 1);
+			if (w->flushfd < 0)
+				return w->flushfd;
+		}
+	}
+
+	return 0;
+}
+
+static void evwriter_kick(struct evwriter *w)
+{
+	if (__atomic_exchange_n(&w->idle, 0, __ATOMIC_SEQ_CST))
+		eventfd_write(w->kickfd, 1);
+}
+
+static inline size_t evwriter_room(struct evwriter *w, uint64_t head)
+{
+	return w->size - (head - __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST));
+}
+
+static int evwriter_push(struct evwriter *w, event_t *ev, size_t size)
+{
+	struct evwriter_ent *ent;
+	size_t need, off, room;
+	uint64_t head = w->head;
+	eventfd_t val;
+
+	need = (sizeof(*ent) + size + 7) & ~7;
+	if (need > (w->size >> 1)) {
+		_e("event of %zu bytes does not fit in the async queue", size);
+		return -E2BIG;
+	}
+
+	off  = head & (w->size - 1);
+	room = w->size - off;
+	if (room < need)
+		need += room;
+
+	while (evwriter_room(w, head) < need) {
+		__atomic_store_n(&w->full, 1, __ATOMIC_SEQ_CST);
+		evwriter_kick(w);
+
+		/* the writer might have made room before it saw the
+		 * flag, check again before going to sleep. */
+		if (evwriter_room(w, head) >= need)
+			break;
+
+		eventfd_read(w->spacefd, &val);
+	}
+
+	if (room < need) {
+		ent = (void *)(w->buf + off);
+		ent->len = 0;
+
+		head += room;
+		need -= room;
+		off = 0;
+	}
+
+	ent = (void *)(w->buf + off);
+	ent->len  = need;
+	ent->size = size;
+	memcpy(ent->data, ev, size);
+
+	__atomic_store_n(&w->head, head + need, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int evwriter_output(struct evwriter *w)
+{
+	ssize_t len;
+	char *buf;
+	size_t left;
+	int err = 0;
+
+	fflush(w->out);
+
+	/* the buffer only holds whole events. the stdout lock keeps
+	 * them apart from interval map dumps, which are written
+	 * through stdio by the main thread. */
+	flockfile(stdout);
+	for (buf = w->obuf, left = w->olen; left; buf += len, left -= len) {
+		len = write(STDOUT_FILENO, buf, left);
+		if (len < 0) {
+			if (errno == EINTR) {
+				len = 0;
+				continue;
+			}
+
+			_eno("could not write output");
+			err = -errno;
+			break;
+		}
+	}
+	funlockfile(stdout);
+
+	rewind(w->out);
+	return err;
+}
+
+static int evwriter_consume(struct evwriter *w)
+{
+	struct evwriter_ent *ent;
+	uint64_t head, tail = w->tail;
+	int n = 0;
+
+	head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		ent = (void *)(w->buf + (tail & (w->size - 1)));
+		if (!ent->len) {
+			tail += w->size - (tail & (w->size - 1));
+			continue;
+		}
+
+		if (!w->err)
+			w->err = event_call(w->out, (void *)ent->data, ent->size);
+
+		tail += ent->len;
+		n++;
+	}
+
+	/* everything is formatted, release the space before doing
+	 * the potentially slow write. */
+	__atomic_store_n(&w->tail, tail, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&w->full, 0, __ATOMIC_SEQ_CST))
+		eventfd_write(w->spacefd, 1);
+
+	if (n && !w->err)
+		w->err = evwriter_output(w);
+
+	return n;
+}
+
+static void *evwriter_run(void *_w)
+{
+	struct evwriter *w = _w;
+	eventfd_t val;
+
+	for (;;) {
+		if (evwriter_consume(w))
+			continue;
+
+		if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+			evwriter_consume(w);
+			break;
+		}
+
+		__atomic_store_n(&w->idle, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) != w->tail ||
+		    __atomic_load_n(&w->stop, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&w->idle, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		eventfd_read(w->kickfd, &val);
+	}
+
+	return NULL;
+}
+
+static int evwriter_start(struct evwriter *w)
+{
+	int err;
+
+	/* from here on, stdout is written by the writer */
+	fflush(stdout);
+
+	err = pthread_create(&w->thread, NULL, evwriter_run, w);
+	if (err) {
+		_e("could not start writer: %s", strerror(err));
+		return -err;
+	}
+
+	return 0;
+}
+
+static int evwriter_stop(struct evwriter *w)
+{
+	__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+	eventfd_write(w->kickfd, 1);
+
+	pthread_join(w->thread, NULL);
+	writer = NULL;
+	return w->err;
+}
+
+static int evwriter_init(size_t size)
+{
+	struct evwriter *w;
+
+	w = calloc(1, sizeof(*w));
+	assert(w);
+
+	for (w->size = 0x1000; w->size < size; w->size <<= 1);
+	w->buf = malloc(w->size);
+	assert(w->buf);
+
+	w->kickfd  = eventfd(0, EFD_CLOEXEC);
+	w->spacefd = eventfd(0, EFD_CLOEXEC);
+	if (w->kickfd < 0 || w->spacefd < 0) {
+		_eno("could not create writer");
+		return -errno;
+	}
+
+	w->out = open_memstream(&w->obuf, &w->olen);
+	assert(w->out);
+
+	writer = w;
+	return 0;
+}
+
+static int evpipe_signals(evpipe_t *evp)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EVP_SIG };
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (G.flight || G.stats)
+		sigaddset(&mask, SIGUSR1);
+
+	/* signals are delivered through the signalfd, so block the
+	 * default disposition from killing us. */
+	if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+		_eno("could not block signals");
+		return -errno;
+	}
+
+	evp->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (evp->sigfd < 0) {
+		_eno("could not create signalfd");
+		return -errno;
+	}
+
+	if (epoll_ctl(evp->epfd, EPOLL_CTL_ADD, evp->sigfd, &ev)) {
+		_eno("could not poll signalfd");
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int evpipe_loop_setup(evpipe_t *evp)
+{
+	int batched = G.wakeup_bytes || G.wakeup_events > 1;
+	long period = G.latency;
+	int err;
+
+	err = evpipe_signals(evp);
+	if (err)
+		return err;
+
+	if (G.timeout) {
+		evp->timeoutfd = evpipe_timer(evp->epfd, EVP_TIMEOUT,
+					      (long)G.timeout * 1000, 0);
+		if (evp->timeoutfd < 0)
+			return evp->timeoutfd;
+	}
+
+	/* when wakeups are batched, a quiet queue could hold on to
+	 * its events indefinitely. bound the latency by periodically
+	 * draining all queues. in ordered mode, samples are held back
+	 * until they are older than the window, which also needs a
+	 * timer to make progress. */
+	if (evp->order && (!batched || G.order < period))
+		period = G.order;
+
+	if (!evp->nworkers && !G.flight && (batched || evp->order)) {
+		evp->flushfd = evpipe_timer(evp->epfd, EVP_FLUSH, period, 1);
+		if (evp->flushfd < 0)
+			return evp->flushfd;
+	}
+
+	if (G.stats_period) {
+		evp->statsfd = evpipe_timer(evp->epfd, EVP_STATS, G.stats_period, 1);
+		if (evp->statsfd < 0)
+			return evp->statsfd;
+	}
+
+	if (G.interval && evp->tick) {
+		evp->tickfd = evpipe_timer(evp->epfd, EVP_TICK, G.interval, 1);
+		if (evp->tickfd < 0)
+			return evp->tickfd;
+	}
+
+	if (G.ttl && evp->sweep) {
+		evp->sweepfd = evpipe_timer(evp->epfd, EVP_SWEEP, G.ttl, 1);
+		if (evp->sweepfd < 0)
+			return evp->sweepfd;
+	}
+
+	return 0;
+}
+
+static void evpipe_lost_summary(evpipe_t *evp)
+{
+	uint64_t lost = 0;
+	uint32_t i;
+	int cpu;
+
+	for (i = 0; i < evp->nqueues; i++)
+		lost += evp->q[i].st.lost;
+
+	if (evp->rb)
+		lost += evp->rb->st.lost;
+
+	if (!lost)
+		return;
+
+	_w("lost %"PRIu64" events in total, consider a larger "
+	   "queue size (-b)", lost);
+	for (i = 0; i < evp->nqueues; i++) {
+		if (evp->q[i].st.lost)
+			_w("  cpu%u: %"PRIu64" events lost, queue size %zu",
+			   evp->q[i].cpu, evp->q[i].st.lost, evp->q[i].size);
+	}
+
+	if (!evp->rb)
+		return;
+
+	for (cpu = 0; cpu < evp->rb->ncpus; cpu++) {
+		if (evp->rb->seen[cpu])
+			_w("  cpu%d: %"PRIu64" events lost, ring size %zu",
+			   cpu, evp->rb->seen[cpu], evp->rb->size);
+	}
+}
+
+static void evstats_print(const char *name, struct evstats *st)
+{
+	fprintf(stderr, "%-6s %12"PRIu64" %14"PRIu64" %10"PRIu64" %10"PRIu64
+		" %10.1f %10.1f\n", name, st->records, st->bytes, st->lost,
+		st->wakeups, st->drain_ns / 1e6, st->handler_ns / 1e6);
+}
+
+static void evstats_add(struct evstats *total, struct evstats *st)
+{
+	total->records    += st->records;
+	total->bytes      += st->bytes;
+	total->lost       += st->lost;
+	total->wakeups    += st->wakeups;
+	total->drain_ns   += st->drain_ns;
+	total->handler_ns += st->handler_ns;
+}
+
+static void evpipe_stats(evpipe_t *evp)
+{
+	struct evstats total = { 0 };
+	char name[16];
+	uint32_t i;
+
+	fflush(stdout);
+
+	fprintf(stderr, "%-6s %12s %14s %10s %10s %10s %10s\n", "queue",
+		"records", "bytes", "lost", "wakeups", "drain-ms", "handler-ms");
+
+	if (evp->rb) {
+		evstats_print("ring", &evp->rb->st);
+		evstats_add(&total, &evp->rb->st);
+	}
+
+	for (i = 0; i < evp->nqueues; i++) {
+		snprintf(name, sizeof(name), "cpu%u", evp->q[i].cpu);
+		evstats_print(name, &evp->q[i].st);
+		evstats_add(&total, &evp->q[i].st);
+	}
+
+	if (evp->nqueues > 1)
+		evstats_print("total", &total);
+}
+
+int evpipe_loop(evpipe_t *evp, int strict)
+{
+	struct epoll_event evs[16];
+	struct signalfd_siginfo si;
+	uint64_t expirations;
+	int err, i, ready;
+
+	evp->strict = strict;
+
+	err = evpipe_loop_setup(evp);
+	if (err)
+		return err;
+
+	if (evp->nworkers) {
+		err = evworkers_start(evp);
+		if (err)
+			return err;
+	}
+
+	if (writer) {
+		err = evwriter_start(writer);
+		if (err) {
+			if (evp->nworkers)
+				evworkers_stop(evp);
+			return err;
+		}
+	}
+
+	for (;;) {
+		ready = epoll_wait(evp->epfd, evs, 16, -1);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+
+			_eno("could not wait for events");
+			err = -errno;
+			goto stop;
+		}
+
+		for (i = 0; i < ready; i++) {
+			switch (evs[i].data.u32) {
+			case EVP_SIG:
+				if (read(evp->sigfd, &si, sizeof(si)) != sizeof(si))
+					break;
+
+				_d("caught signal %u", si.ssi_signo);
+				if (si.ssi_signo == SIGUSR1) {
+					if (G.flight)
+						err = evpipe_snapshot(evp, strict);
+					if (G.stats)
+						evpipe_stats(evp);
+					break;
+				}
+
+				goto out;
+
+			case EVP_TIMEOUT:
+			case EVP_STOP:
+				goto out;
+
+			case EVP_FLUSH:
+				if (read(evp->flushfd, &expirations,
+					 sizeof(expirations)) < 0)
+					break;
+
+				err = evpipe_flush(evp, strict);
+				break;
+
+			case EVP_STATS:
+				if (read(evp->statsfd, &expirations,
+					 sizeof(expirations)) < 0)
+					break;
+
+				evpipe_stats(evp);
+				break;
+
+			case EVP_TICK:
+				if (read(evp->tickfd, &expirations,
+					 sizeof(expirations)) < 0)
+					break;
+
+				err = evp->tick(evp->tick_priv);
+				break;
+
+			case EVP_SWEEP:
+				if (read(evp->sweepfd, &expirations,
+					 sizeof(expirations)) < 0)
+					break;
+
+				err = evp->sweep(evp->sweep_priv);
+				break;
+
+			case EVP_RING:
+				evp->rb->st.wakeups++;
+				err = evring_drain(evp, stdout);
+				break;
+
+			default:
+				evp->q[evs[i].data.u32].st.wakeups++;
+				if (evp->order) {
+					err = evorder_drain(evp, strict, 0);
+					break;
+				}
+
+				err = evqueue_drain(&evp->q[evs[i].data.u32],
+						    stdout, strict);
+				break;
+			}
+
+			if (err)
+				goto stop;
+		}
+
+		if (writer)
+			evwriter_kick(writer);
+	}
+
+out:
+	/* pick up any stragglers left behind by batched wakeups,
+	 * workers do so themselves when stopped. */
+	if (!evp->nworkers)
+		err = evp->order ? evorder_drain(evp, strict, 1) :
+			evpipe_flush(evp, strict);
+stop:
+	/* every exit stops and joins the workers, they still read
+	 * from the queues. the first error is kept. */
+	if (evp->nworkers) {
+		int werr = evworkers_stop(evp);
+
+		err = err ? : werr;
+	}
+
+	evpipe_lost_summary(evp);
+	if (G.stats)
+		evpipe_stats(evp);
+
+	if (writer) {
+		int werr = evwriter_stop(writer);
+
+		err = err ? : werr;
+	}
+
+	return err;
+}
+
+static int evpipe_record_open(evpipe_t *evp, const char *path)
+{
+	struct evrec_hdr hdr = {
+		.magic       = EVREC_MAGIC,
+		.version     = EVREC_VERSION,
+		.backend     = evp->ringbuf ? EVREC_RINGBUF : EVREC_PERF,
+		.sample_type = sample_type,
+
+		.nhandlers     = next_type,
+		.handlers_hash = evhandler_hash(),
+	};
+
+	evp->recfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			  O_CLOEXEC, 0644);
+	if (evp->recfd < 0) {
+		_eno("could not create recording '%s'", path);
+		return -errno;
+	}
+
+	if (write(evp->recfd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		_eno("could not write recording header");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int evrec_replay_perf(uint8_t *rec, uint8_t *end, int strict)
+{
+	struct perf_event_header *hdr;
+	struct evstats st = { 0 };
+	int err = 0;
+
+	for (; !err && rec < end; rec += hdr->size) {
+		hdr = (void *)rec;
+
+		if (end - rec < sizeof(*hdr) || !hdr->size ||
+		    end - rec < hdr->size) {
+			_e("recording is truncated");
+			return -EINVAL;
+		}
+
+		err = event_dispatch(stdout, hdr, strict, &st);
+	}
+
+	return err;
+}
+
+static int evrec_replay_ringbuf(uint8_t *rec, uint8_t *end)
+{
+#ifdef LINUX_HAS_RINGBUF
+	struct evstats st = { 0 };
+	uint32_t len;
+	int err = 0;
+
+	for (; !err && rec < end; rec += evring_rec_size(len)) {
+		if (end - rec < BPF_RINGBUF_HDR_SZ) {
+			_e("recording is truncated");
+			return -EINVAL;
+		}
+
+		len = *(uint32_t *)rec;
+		if (end - rec < evring_rec_size(len)) {
+			_e("recording is truncated");
+			return -EINVAL;
+		}
+
+		if (len & BPF_RINGBUF_DISCARD_BIT)
+			continue;
+
+		if (len < sizeof(event_t)) {
+			_e("malformed ringbuf record, size:%#"PRIx32, len);
+			return -EINVAL;
+		}
+
+		err = event_handle(stdout, (void *)(rec + BPF_RINGBUF_HDR_SZ),
+				   len, &st);
+	}
+
+	return err;
+#else
+	_e("replaying ringbuf recordings requires linux 5.8 or later");
+	return -ENOSYS;
+#endif
+}
+
+int evpipe_replay(const char *path, int strict)
+{
+	struct evrec_hdr *hdr;
+	struct stat st;
+	uint8_t *data, *end;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		_eno("could not open recording '%s'", path);
+		return -errno;
+	}
+
+	if (fstat(fd, &st)) {
+		_eno("could not stat recording '%s'", path);
+		err = -errno;
+		goto out_close;
+	}
+
+	if (st.st_size < sizeof(*hdr)) {
+		_e("'%s' is not a recording", path);
+		err = -EINVAL;
+		goto out_close;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		_eno("could not map recording '%s'", path);
+		err = -errno;
+		goto out_close;
+	}
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	hdr = (void *)data;
+	if (memcmp(hdr->magic, EVREC_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != EVREC_VERSION ||
+	    hdr->backend > EVREC_RINGBUF ||
+	    (hdr->sample_type & ~PERF_SAMPLE_TIME) != PERF_SAMPLE_RAW) {
+		_e("'%s' is not a supported recording", path);
+		err = -EINVAL;
+		goto out_unmap;
+	}
+
+	if (hdr->nhandlers != next_type ||
+	    hdr->handlers_hash != evhandler_hash()) {
+		_e("'%s' was recorded with a different script", path);
+		err = -EINVAL;
+		goto out_unmap;
+	}
+
+	sample_type = hdr->sample_type;
+
+	end = data + st.st_size;
+	if (hdr->backend == EVREC_RINGBUF)
+		err = evrec_replay_ringbuf(data + sizeof(*hdr), end);
+	else
+		err = evrec_replay_perf(data + sizeof(*hdr), end, strict);
+
+	fflush(stdout);
+
+out_unmap:
+	munmap(data, st.st_size);
+out_close:
+	close(fd);
+	return err;
+}
+
+#define CPUSET_BITS (8 * sizeof(unsigned long))
+
+static int evpipe_cpus(evpipe_t *evp, const char *list)
+{
+	unsigned long *set;
+	char *end;
+	long lo, hi, cpu;
+	int err = 0;
+
+	evp->q = calloc(evp->ncpus, sizeof(*evp->q));
+	assert(evp->q);
+
+	if (!list) {
+		for (cpu = 0; cpu < evp->ncpus; cpu++)
+			evp->q[evp->nqueues++].cpu = cpu;
+
+		return 0;
+	}
+
+	set = calloc((evp->ncpus + CPUSET_BITS - 1) / CPUSET_BITS,
+		     sizeof(*set));
+	assert(set);
+
+	/* list of cpus and cpu ranges, e.g. "0-3,8" */
+	for (end = (char *)list; *list; list = end + 1) {
+		lo = hi = strtol(list, &end, 0);
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 0);
+
+		if (end == list || lo < 0 || hi < lo || hi >= evp->ncpus ||
+		    (*end && *end != ',') || (*end && !end[1])) {
+			_e("invalid cpu list, expected e.g. \"0-3,8\" where "
+			   "no cpu is above %u", evp->ncpus - 1);
+			err = -EINVAL;
+			goto out;
+		}
+
+		for (cpu = lo; cpu <= hi; cpu++) {
+			if (set[cpu / CPUSET_BITS] & (1UL << (cpu % CPUSET_BITS))) {
+				_e("cpu %ld is listed more than once", cpu);
+				err = -EINVAL;
+				goto out;
+			}
+
+			set[cpu / CPUSET_BITS] |= 1UL << (cpu % CPUSET_BITS);
+		}
+
+		if (!*end)
+			break;
+	}
+
+	for (cpu = 0; cpu < evp->ncpus; cpu++)
+		if (set[cpu / CPUSET_BITS] & (1UL << (cpu % CPUSET_BITS)))
+			evp->q[evp->nqueues++].cpu = cpu;
+
+	if (!evp->nqueues) {
+		_e("cpu list is empty");
+		err = -EINVAL;
+	}
+out:
+	free(set);
+	return err;
+}
+
+static int evpipe_init_ringbuf(evpipe_t *evp, size_t qsize)
+{
+	size_t size;
+
+	if (G.flight) {
+		_e("flight mode requires the perf backend");
+		return -EINVAL;
+	}
+
+	if (G.cpus || G.bufauto || G.workers)
+		_w("-C, -j and \"-b auto\" do not apply to the ringbuf "
+		   "backend, ignoring");
+
+	/* one ring is shared by all cpus, give it the same total
+	 * capacity as the per-cpu queues would have had, within what
+	 * the kernel allows for a single ring. */
+	for (size = qsize; size < qsize * evp->ncpus; size <<= 1) {
+		if (size >= EVRING_SIZE_MAX) {
+			_w("limiting ringbuf to %zuM", size >> 20);
+			break;
+		}
+	}
+
+	return evring_init(evp, size);
+}
+
+int evpipe_init(evpipe_t *evp, size_t qsize)
+{
+	size_t size;
+	uint32_t i;
+	int err;
+
+	evp->ringbuf = G.ringbuf;
+
+	if (G.order) {
+		if (G.ringbuf || G.flight) {
+			_w("-O does not apply to %s, ignoring",
+			   G.ringbuf ? "the ringbuf backend, which is "
+			   "always ordered" : "flight mode");
+			G.order = 0;
+		} else {
+			if (G.bufauto || G.workers)
+				_w("-j and \"-b auto\" do not apply to "
+				   "ordered mode, ignoring");
+
+			G.bufauto = 0;
+			G.workers = 0;
+			sample_type |= PERF_SAMPLE_TIME;
+		}
+	}
+
+	if (G.async && G.workers) {
+		_w("-j does not apply to async mode, ignoring");
+		G.workers = 0;
+	}
+
+	if (G.dump) {
+		evp->mapfd = 0xeeee;
+		return 0;
+	}
+
+	evp->ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* queues are sized in pages, which must be a power of two */
+	for (size = sysconf(_SC_PAGESIZE); size < qsize; size <<= 1);
+	if (size != qsize)
+		_d("rounding queue size up to %zu bytes", size);
+	qsize = size;
+
+	evp->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (evp->epfd < 0) {
+		_eno("could not create epoll instance");
+		return evp->epfd;
+	}
+
+	if (G.record) {
+		err = evpipe_record_open(evp, G.record);
+		if (err)
+			return err;
+	} else if (G.async) {
+		err = evwriter_init(G.async);
+		if (err)
+			return err;
+	}
+
+	if (evp->ringbuf)
+		return evpipe_init_ringbuf(evp, qsize);
+
+	if (G.flight) {
+#ifndef LINUX_HAS_WRITE_BACKWARD
+		_e("flight mode requires linux 4.7 or later");
+		return -ENOSYS;
+#endif
+		if (G.bufauto || G.workers)
+			_w("-j and \"-b auto\" do not apply to flight mode, "
+			   "ignoring");
+
+		G.bufauto = 0;
+		G.workers = 0;
+	}
+
+	evp->mapfd = bpf_map_create(BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+				    sizeof(uint32_t), sizeof(int), evp->ncpus);
+	if (evp->mapfd < 0) {
+		_eno("could not create map");
+		return evp->mapfd;
+	}
+
+	if (G.wakeup_bytes >= qsize) {
+		_w("wakeup watermark exceeds queue size, using %zu bytes",
+		   qsize >> 1);
+		G.wakeup_bytes = qsize >> 1;
+	}
+
+	/* events from cpus without a queue are dropped by the kernel */
+	err = evpipe_cpus(evp, G.cpus);
+	if (err)
+		return err;
+
+	evp->nworkers = G.workers;
+	if (evp->nworkers) {
+		err = evworkers_init(evp);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < evp->nqueues; i++) {
+		err = evqueue_init(evp, &evp->q[i], qsize);
+		if (err)
+			return err;
+	}
+
+	if (G.order && !G.record)
+		err = evorder_init(evp);
+
 	return err;
 }
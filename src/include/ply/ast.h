@@ -195,10 +195,31 @@ struct dyn {
 		struct {
 			mdumper_t dump;
 			cmper_t cmp;
+
+			/* parameters of the dump function */
+			void *priv;
+
+			/* names of the int64 words of a composite
+			 * value, NULL terminated. */
+			const char *const *words;
+
+			/* values are int64 counters that only ever
+			 * increase, interval output can report the
+			 * difference between two snapshots. */
+			int counters;
 		} map;
 
 		struct {
 			const func_t *func;
+
+			/* stack location of the run-time length of a
+			 * variable sized result, 0 if it is fixed. */
+			ssize_t len;
+
+			/* the method adds to the map value in place,
+			 * the value is neither loaded nor stored
+			 * around the call. */
+			int inplace;
 		} call;
 
 		struct {
@@ -221,6 +242,11 @@ struct dyn {
 		struct {
 			symtable_t *st;
 			evpipe_t   *evp;
+
+			/* array selecting the buffer that probes
+			 * write to in double buffered maps. */
+			int      epochfd;
+			uint32_t epoch;
 		} script;
 	};
 };
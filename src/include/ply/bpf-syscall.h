@@ -20,6 +20,7 @@
 #ifndef _PLY_BPF_SYSCALL_H
 #define _PLY_BPF_SYSCALL_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 #include <linux/bpf.h>
@@ -34,20 +35,47 @@ int bpf_prog_load(enum bpf_prog_type type,
 		  const struct bpf_insn *insns, int insn_cnt);
 
 int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries);
+int bpf_map_create_flags(enum bpf_map_type type, int key_sz, int val_sz,
+			 int entries, uint32_t flags);
 
 int bpf_map_lookup(int fd, void *key, void *val);
 int bpf_map_update(int fd, void *key, void *val, int flags);
 int bpf_map_delete(int fd, void *key);
 int bpf_map_next  (int fd, void *key, void *next_key);
+int bpf_map_lookup_batch(int fd, void *in_batch, void *out_batch,
+			 void *keys, void *vals, uint32_t *count);
 
 long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 		     int cpu, int group_fd, unsigned long flags);
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0))
 #define LINUX_HAS_STACKMAP
+#define LINUX_HAS_PERCPU_MAPS
 #endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0))
 #define LINUX_HAS_TRACEPOINT
+#define LINUX_HAS_WRITE_BACKWARD
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0))
+#define LINUX_HAS_LRU_MAPS
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0))
+#define LINUX_HAS_FIRST_KEY
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0))
+/* probe_read_str, and helper sizes that are only bounded, not
+ * constant, at load time. */
+#define LINUX_HAS_VARLEN
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+/* direct access to array values from ld_imm64 */
+#define LINUX_HAS_MAP_VALUE
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0))
+#define LINUX_HAS_RINGBUF
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
+#define LINUX_HAS_MAP_BATCH
 #endif
 
 #endif	/* _PLY_BPF_SYSCALL_H */
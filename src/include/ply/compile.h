@@ -25,6 +25,7 @@
 #include <linux/bpf.h>
 
 #include <ply/ast.h>
+#include <ply/bpf-syscall.h>
 
 #define INSN(_code, _dst, _src, _off, _imm)	\
 	((struct bpf_insn) {			\
@@ -51,6 +52,7 @@
 #define STXH(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_H) | BPF_MEM, _dst, _src, _off, 0)
 #define STXW(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_W) | BPF_MEM, _dst, _src, _off, 0)
 #define STXDW(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_DW) | BPF_MEM, _dst, _src, _off, 0)
+#define XADDDW(_dst, _off, _src)  INSN(BPF_STX | BPF_SIZE(BPF_DW) | BPF_XADD, _dst, _src, _off, 0)
 
 #define LDXB(_dst, _off, _src)  INSN(BPF_LDX | BPF_SIZE(BPF_B)  | BPF_MEM, _dst, _src, _off, 0)
 #define LDXH(_dst, _off, _src)  INSN(BPF_LDX | BPF_SIZE(BPF_H)  | BPF_MEM, _dst, _src, _off, 0)
@@ -68,11 +70,13 @@ typedef struct prog {
 extern const dyn_t dyn_reg[];
 
 void emit           (prog_t *prog, struct bpf_insn insn);
+void emit_at        (prog_t *prog, struct bpf_insn *at, struct bpf_insn insn);
 int  emit_stack_zero(prog_t *prog, const node_t *n);
 int  emit_xfer_dyns (prog_t *prog, const dyn_t  *to, const dyn_t  *from);
 int  emit_xfer_dyn  (prog_t *prog, const dyn_t  *to, const node_t *from);
 int  emit_xfer      (prog_t *prog, const node_t *to, const node_t *from);
 int  emit_read_raw  (prog_t *prog, ssize_t to, int from, size_t size);
+int  emit_bound     (prog_t *prog, int reg, int32_t max);
 
 static inline void emit_ld_mapfd(prog_t *prog, int reg, int fd)
 {
@@ -80,9 +84,32 @@ static inline void emit_ld_mapfd(prog_t *prog, int reg, int fd)
 	emit(prog, INSN(0, 0, 0, 0, 0));
 }
 
+static inline void emit_ld_imm64(prog_t *prog, int reg, uint64_t imm)
+{
+	emit(prog, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, 0, 0, (uint32_t)imm));
+	emit(prog, INSN(0, 0, 0, 0, imm >> 32));
+}
+
+#ifdef LINUX_HAS_MAP_VALUE
+/* pointer to the value at off of the first element of an array */
+static inline void emit_ld_mapval(prog_t *prog, int reg, int fd, int32_t off)
+{
+	emit(prog, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_VALUE, 0, fd));
+	emit(prog, INSN(0, 0, 0, 0, off));
+}
+#endif
+
 int emit_log2_raw      (prog_t *prog, int dst, int src);
-int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val);
-int emit_map_lookup_raw(prog_t *prog, int fd, ssize_t addr);
+int emit_map_update_raw(prog_t *prog, node_t *map, ssize_t key, ssize_t val);
+int emit_map_lookup_raw(prog_t *prog, node_t *map, ssize_t addr);
+int emit_map_xadd      (prog_t *prog, node_t *map);
+
+/* called with r0 pointing to the map entry, and val being the stack
+ * location of the value to merge into it. */
+typedef void (*inplace_t)(prog_t *prog, ssize_t val);
+
+int emit_map_inplace(prog_t *prog, node_t *map, inplace_t update);
+int emit_map_lookup_or_insert(prog_t *prog, node_t *map);
 
 prog_t *compile_probe(node_t *probe);
 
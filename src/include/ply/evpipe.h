@@ -21,41 +21,76 @@
 #define _PLY_EVPIPE_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include <linux/perf_event.h>
 
-#include <sys/queue.h>
-
+/* event as output by a probe, independent of the backend used to
+ * transport it. a 32-bit type keeps the data of perf samples 8-byte
+ * aligned without any padding. */
 typedef struct event {
-	struct perf_event_header hdr;
-	uint32_t size;
-
-	uint64_t type;
+	uint32_t type;
 	uint8_t  data[0];
 } __attribute__((packed)) event_t;
 
 typedef struct evhandler {
-	TAILQ_ENTRY(evhandler) node;
-
-	uint64_t type;
+	uint32_t type;
 	void *priv;
 
-	int (*handle)(event_t *ev, void *priv);
+	/* layout of the handler's events, e.g. a format string. a
+	 * recording is only replayed by a script whose handlers all
+	 * match the ones it was recorded with. */
+	const char *desc;
+
+	int (*handle)(FILE *fp, event_t *ev, size_t size, void *priv);
 } evhandler_t;
 
+/* upper bound of the per-cpu queue size, -b */
+#define EVPIPE_QSIZE_MAX (1UL << 30)
+
+struct evorder;
 struct evqueue;
+struct evring;
+struct evworker;
 
 typedef struct evpipe {
 	int mapfd;
+	int lostfd;
+	int strict;
+	int ringbuf;
+
+	int epfd;
+	int sigfd;
+	int timeoutfd;
+	int flushfd;
+	int stopfd;
+	int recfd;
+	int statsfd;
+	int tickfd;
+	int sweepfd;
+
+	/* called from the loop every G.interval */
+	int (*tick)(void *priv);
+	void *tick_priv;
+
+	/* called from the loop every G.ttl */
+	int (*sweep)(void *priv);
+	void *sweep_priv;
 
 	uint32_t ncpus;
-	struct pollfd *poll;
+	uint32_t nqueues;
 	struct evqueue *q;
+	struct evring  *rb;
+	struct evorder *order;
+
+	int nworkers;
+	struct evworker *w;
 } evpipe_t;
 
 void evhandler_register(evhandler_t *evh);
 
-int evpipe_loop(evpipe_t *evp, int *sig, int strict);
+int evpipe_loop  (evpipe_t *evp, int strict);
+int evpipe_replay(const char *path, int strict);
 int evpipe_init(evpipe_t *evp, size_t qsize);
 
 #endif	/* _PLY_EVPIPE_H */
@@ -29,6 +29,8 @@ void dump_node(FILE *fp, node_t *n, void *data);
 int  cmp_node(node_t *n, const void *a, const void *b);
 
 int map_setup   (node_t *script);
+int map_interval(node_t *script);
+int map_sweep   (node_t *script);
 int map_teardown(node_t *script);
 
 #endif	/* _PLY_MAP_H */
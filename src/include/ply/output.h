@@ -0,0 +1,78 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PLY_OUTPUT_H
+#define _PLY_OUTPUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <ply/ast.h>
+#include <ply/evpipe.h>
+
+typedef enum output_fmt {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_CSV,
+	OUTPUT_BINARY,
+} output_fmt_t;
+
+int output_fmt_parse(const char *name);
+
+/* output is assembled in a buffer on the stack and written to the
+ * stream in large chunks. */
+typedef struct obuf {
+	FILE  *fp;
+	size_t len;
+	char   data[0x1000];
+} obuf_t;
+
+void  obuf_flush(obuf_t *ob);
+void  obuf_put  (obuf_t *ob, const char *str, size_t len);
+void  obuf_pad  (obuf_t *ob, char c, int n);
+char *obuf_utoa (char *end, uint64_t v, char conv);
+
+/* binary output is a stream of frames, each starting with this
+ * header. len includes the header and is always a multiple of 8. */
+#define OFRAME_EVENT 1
+#define OFRAME_MAP   2
+#define OFRAME_ENTRY 3
+
+struct oframe {
+	uint32_t len;
+	uint32_t kind;
+	uint8_t  data[0];
+};
+
+/* flattened layout of a map entry or event. the leaves of any nested
+ * records are listed in order, the first nkeys make up the key. */
+typedef struct oenc {
+	const char *name;
+
+	int     nkeys;
+	int     nfields;
+	node_t *fields[0];
+} oenc_t;
+
+oenc_t *oenc_new(const char *name, node_t *keys, node_t *val);
+
+int  output_event(FILE *fp, oenc_t *enc, event_t *ev, size_t size);
+void output_map  (FILE *fp, node_t *map, void *data, int len, size_t rsize);
+
+#endif	/* _PLY_OUTPUT_H */
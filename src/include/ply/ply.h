@@ -24,6 +24,8 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#include <sys/types.h>
+
 #include <ply/kallsyms.h>
 #include <ply/ast.h>
 
@@ -55,13 +57,43 @@ struct globals {
 	int timeout;
 	pid_t self;
 
+	int  wakeup_events;
+	int  wakeup_bytes;
+	long latency;
+	int  workers;
+
+	size_t bufsize;
+	int    bufauto;
+	const char *cpus;
+	int    ringbuf;
+	int    flight;
+	long   order;
+	size_t async;
+	int    format;
+	int    stats;
+	long   stats_period;
+	long   interval;
+	int    cumulative;
+	size_t top;
+	char **tops;
+	int    ntops;
+	int    lru;
+	long   ttl;
+
+	const char *record;
+	const char *replay;
+
 	size_t map_nelem;
 
 	ksyms_t *ksyms;
 };
 extern struct globals G;
 
-char *str_escape(char *str);
+char   *str_escape  (char *str);
+ssize_t str_to_size (const char *str);
+long    str_to_msecs(const char *str, long unit);
+
+int cpus_possible(void);
 
 int annotate_script(node_t *script);
 
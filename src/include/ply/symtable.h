@@ -28,10 +28,34 @@ typedef struct sym sym_t;
 
 struct sym_map_data {
 	int fd;
+
+	/* double buffered maps, the buffer written by probes while
+	 * the epoch is odd. 0 for regular maps. */
+	int fd1;
 	enum bpf_map_type type;
 	size_t ksize, vsize, nelem;
 
+	/* BPF_F_* flags to create the map with */
+	uint32_t flags;
+
+	/* the map has been reported as full */
+	int full;
+
 	node_t *map;
+
+	/* read or written other than through aggregation methods */
+	int direct;
+
+	/* only print this many entries, 0 for all */
+	size_t top;
+
+	/* interval output, the previous snapshot sorted by key */
+	char  *prev;
+	size_t nprev;
+
+	/* ttl sweeps, the entries seen by the previous sweep */
+	char  *seen;
+	size_t nseen;
 };
 
 struct sym {
@@ -19,15 +19,21 @@
 
 #define _GNU_SOURCE
 
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+
 #include <ply/ply.h>
 #include <ply/bpf-syscall.h>
 #include <ply/map.h>
+#include <ply/output.h>
 #include <ply/symtable.h>
 
 #define PTR_W ((int)(sizeof(uintptr_t) * 2))
@@ -210,6 +216,106 @@ int cmp_map(const void *ak, const void *bk, void *_map)
 	return cmp_node(map, av, bv);
 }
 
+/* entries are read in chunks of this many. the dump buffer grows
+ * with the number of live entries, not with the map's capacity. */
+#define MAP_CHUNK 0x100
+
+static void map_grow(char **data, size_t *cap, size_t n, size_t rsize)
+{
+	if (n < *cap)
+		return;
+
+	*cap = *cap ? (*cap << 1) : MAP_CHUNK;
+	*data = realloc(*data, *cap * rsize);
+	assert(*data);
+}
+
+static int map_is_percpu(sym_t *s)
+{
+	switch (s->map->type) {
+	case BPF_MAP_TYPE_PERCPU_HASH:
+#ifdef LINUX_HAS_LRU_MAPS
+	case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+#endif
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* per-cpu maps hold one value for each possible cpu, each one
+ * padded to 8 bytes. */
+static size_t map_value_size(sym_t *s)
+{
+	if (!map_is_percpu(s))
+		return s->map->vsize;
+
+	return ((s->map->vsize + 7) & ~7) * cpus_possible();
+}
+
+#ifdef LINUX_HAS_MAP_BATCH
+/* returns the number of entries read, or a negative error if the
+ * map does not support batched lookups. */
+static ssize_t map_read_batch(sym_t *s, int fd, char **data, size_t *cap)
+{
+	size_t ksize = s->map->ksize, vsize = map_value_size(s);
+	size_t rsize = ksize + vsize, chunk = MAP_CHUNK;
+	char *keys, *vals, *token;
+	void *in = NULL;
+	uint32_t count, i;
+	ssize_t n = 0;
+	int err;
+
+	keys  = malloc(chunk * ksize);
+	vals  = malloc(chunk * vsize);
+	token = malloc(ksize < sizeof(uint64_t) ? sizeof(uint64_t) : ksize);
+	assert(keys && vals && token);
+
+	for (;;) {
+		count = chunk;
+		err = bpf_map_lookup_batch(fd, in, token,
+					   keys, vals, &count);
+		if (err && errno == ENOSPC && !count) {
+			/* a hash bucket did not fit in one chunk */
+			chunk <<= 1;
+			keys = realloc(keys, chunk * ksize);
+			vals = realloc(vals, chunk * vsize);
+			assert(keys && vals);
+			continue;
+		}
+
+		/* only ENOENT marks the end of the map, anything else
+		 * leaves a partial dump. the caller starts over. */
+		if (err && errno != ENOENT) {
+			n = -errno;
+			break;
+		}
+
+		for (i = 0; i < count; i++, n++) {
+			map_grow(data, cap, n, rsize);
+			memcpy(*data + n * rsize, keys + i * ksize, ksize);
+			memcpy(*data + n * rsize + ksize, vals + i * vsize, vsize);
+		}
+
+		if (err)
+			break;
+
+		in = token;
+	}
+
+	free(token);
+	free(vals);
+	free(keys);
+	return n;
+}
+#else
+static ssize_t map_read_batch(sym_t *s, int fd, char **data, size_t *cap)
+{
+	return -ENOSYS;
+}
+#endif
+
+#ifndef LINUX_HAS_FIRST_KEY
 static void __key_workaround(int fd, void *key, size_t key_sz, void *val)
 {
 	FILE *fp;
@@ -231,43 +337,234 @@ static void __key_workaround(int fd, void *key, size_t key_sz, void *val)
 
 	fclose(fp);
 }
+#endif
 
-void dump_map(node_t *map)
+/* one entry at a time, two syscalls each */
+static ssize_t map_read_iter(sym_t *s, int fd, char **data, size_t *cap)
 {
-	node_t *rec = map->map.rec;
-	sym_t *s = sym_from_node(map);
-	char *data, *key, *val;
-	size_t rsize;
-	int err, n = 0;
+	size_t ksize = s->map->ksize, rsize = ksize + map_value_size(s);
+	char *key, *prev = NULL;
+	ssize_t n;
+
+#ifndef LINUX_HAS_FIRST_KEY
+	char *start = malloc(rsize);
+
+	assert(start);
+	memset(start, 0, rsize);
+	__key_workaround(fd, start, ksize, start + ksize);
+	prev = start;
+#else
+	/* a NULL key is the start of the map */
+#endif
+
+	for (n = 0;; n++) {
+		map_grow(data, cap, n, rsize);
+		key = *data + n * rsize;
+		if (n)
+			prev = key - rsize;
+
+		if (bpf_map_next(fd, prev, key))
+			break;
 
-	rsize = s->map->ksize + s->map->vsize;
+		/* the entry could have been deleted under our feet,
+		 * the iteration can not continue from a missing key. */
+		if (bpf_map_lookup(fd, key, key + ksize))
+			break;
+	}
+
+#ifndef LINUX_HAS_FIRST_KEY
+	free(start);
+#endif
+	return n;
+}
 
-	data = malloc(rsize * s->map->nelem);
-	assert(data);
+/* sum the counters of all cpus into the first one and pack the
+ * entries back to the layout of a regular map. */
+static void map_fold_percpu(sym_t *s, char *data, size_t n)
+{
+	size_t ksize = s->map->ksize, vsize = s->map->vsize;
+	size_t pcpu = (vsize + 7) & ~7, kvsize = map_value_size(s);
+	int cpu, ncpus = cpus_possible();
+	char *in, *out = data;
+	int64_t sum, v;
+	size_t i, off;
+
+	for (i = 0; i < n; i++, out += ksize + vsize) {
+		in = data + i * (ksize + kvsize);
+
+		/* entries only ever move towards the start, but the
+		 * first ones overlap. */
+		memmove(out, in, ksize);
+		in += ksize;
+
+		for (off = 0; off + sizeof(sum) <= vsize; off += sizeof(sum)) {
+			sum = 0;
+			for (cpu = 0; cpu < ncpus; cpu++) {
+				memcpy(&v, in + cpu * pcpu + off, sizeof(v));
+				sum += v;
+			}
+
+			memcpy(out + ksize + off, &sum, sizeof(sum));
+		}
+	}
+}
 
-	key = data;
-	val = data + s->map->ksize;
+static ssize_t map_read_fd(sym_t *s, int fd, char **data)
+{
+	size_t cap = 0;
+	ssize_t n;
 
-	__key_workaround(s->map->fd, key, rec->dyn->size, val);
+	*data = NULL;
 
-	for (err = bpf_map_next(s->map->fd, key, key); !err;
-	     err = bpf_map_next(s->map->fd, key - rsize, key)) {
-		err = bpf_map_lookup(s->map->fd, key, val);
-		if (err)
-			goto out_free;
+	/* batches are unsupported on older kernels, or failed half
+	 * way. either way, walk the whole map one entry at a time. */
+	n = map_read_batch(s, fd, data, &cap);
+	if (n < 0)
+		n = map_read_iter(s, fd, data, &cap);
 
-		n++;
-		key += rsize;
-		val += rsize;
+	if (n > 0 && map_is_percpu(s))
+		map_fold_percpu(s, *data, n);
+
+	return n;
+}
+
+static ssize_t map_read(sym_t *s, char **data)
+{
+	return map_read_fd(s, s->map->fd, data);
+}
+
+static int map_key_cmp(const void *a, const void *b, void *_ksize)
+{
+	return memcmp(a, b, *((size_t *)_ksize));
+}
+
+/* replace the counters of each entry with their increase since the
+ * previous snapshot, which is then replaced by data. entries that
+ * did not change are left out. */
+static char *map_delta(sym_t *s, char *data, size_t n, size_t *nout)
+{
+	size_t ksize = s->map->ksize, rsize = ksize + s->map->vsize, i;
+	char *prev = s->map->prev, *pend = prev + s->map->nprev * rsize;
+	char *cur, *out, *o;
+	int64_t now, then;
+	int changed;
+
+	qsort_r(data, n, rsize, map_key_cmp, &ksize);
+
+	out = malloc(n ? n * rsize : 1);
+	assert(out);
+
+	*nout = 0;
+	for (cur = data; cur < data + n * rsize; cur += rsize) {
+		for (; prev < pend && memcmp(prev, cur, ksize) < 0; prev += rsize);
+
+		o = out + *nout * rsize;
+		memcpy(o, cur, rsize);
+
+		changed = 1;
+		if (prev < pend && !memcmp(prev, cur, ksize)) {
+			changed = 0;
+			for (i = ksize; i + sizeof(now) <= rsize; i += sizeof(now)) {
+				memcpy(&now,  cur  + i, sizeof(now));
+				memcpy(&then, prev + i, sizeof(then));
+				now -= then;
+				memcpy(o + i, &now, sizeof(now));
+
+				changed |= !!now;
+			}
+		}
+
+		if (changed)
+			(*nout)++;
+	}
+
+	free(s->map->prev);
+	s->map->prev  = data;
+	s->map->nprev = n;
+	return out;
+}
+
+#define MAP_ENTRY(_i) (data + heap[_i] * rsize)
+
+static void map_heap_down(node_t *map, char *data, size_t rsize,
+			  size_t *heap, size_t len, size_t i)
+{
+	size_t child, tmp;
+
+	for (; (child = 2 * i + 1) < len; i = child) {
+		if (child + 1 < len &&
+		    cmp_map(MAP_ENTRY(child + 1), MAP_ENTRY(child), map) < 0)
+			child++;
+
+		if (cmp_map(MAP_ENTRY(child), MAP_ENTRY(i), map) >= 0)
+			break;
+
+		tmp = heap[i]; heap[i] = heap[child]; heap[child] = tmp;
 	}
+}
+
+/* move the top entries, i.e. the ones that sort last, to the start
+ * of data. a min-heap of the top entries seen so far is kept, so
+ * that each entry is compared against the smallest of them in
+ * O(log top). */
+static size_t map_select_top(node_t *map, char *data, size_t n,
+			     size_t rsize, size_t top)
+{
+	size_t *heap, i;
+	char *out;
+
+	heap = malloc(top * sizeof(*heap));
+	out  = malloc(top * rsize);
+	assert(heap && out);
+
+	for (i = 0; i < top; i++)
+		heap[i] = i;
+
+	for (i = top / 2; i > 0; i--)
+		map_heap_down(map, data, rsize, heap, top, i - 1);
+
+	for (i = top; i < n; i++) {
+		if (cmp_map(data + i * rsize, MAP_ENTRY(0), map) <= 0)
+			continue;
+
+		heap[0] = i;
+		map_heap_down(map, data, rsize, heap, top, 0);
+	}
+
+	for (i = 0; i < top; i++)
+		memcpy(out + i * rsize, MAP_ENTRY(i), rsize);
+
+	memcpy(data, out, top * rsize);
+	free(out);
+	free(heap);
+	return top;
+}
+
+#undef MAP_ENTRY
+
+static void map_print(node_t *map, char *data, size_t n, size_t rsize)
+{
+	sym_t *s = sym_from_node(map);
+	node_t *rec = map->map.rec;
+	size_t top = s->map->top ? : G.top;
+	char *key, *val;
+
+	/* custom dumps, e.g. histograms, need every entry */
+	if (top && n > top && !map->dyn->map.dump)
+		n = map_select_top(map, data, n, rsize, top);
 
 	qsort_r(data, n, rsize, cmp_map, map);
 
+	if (G.format != OUTPUT_TEXT) {
+		output_map(stdout, map, data, n, rsize);
+		return;
+	}
+
 	printf("\n%s:\n", map->string);
 
 	if (map->dyn->map.dump) {
 		map->dyn->map.dump(stdout, map, data, n);
-		goto out_free;
+		return;
 	}
 
 	for (key = data, val = data + rec->dyn->size; n > 0; n--) {
@@ -279,33 +576,406 @@ void dump_map(node_t *map)
 		key += rsize;
 		val += rsize;
 	}
-out_free:
+}
+
+/* read the buffer of a double buffered map that probes stopped
+ * writing to at the last flip, and clear it for the next one. */
+static ssize_t map_drain(node_t *map, sym_t *s, char **data)
+{
+	size_t rsize = s->map->ksize + s->map->vsize;
+	uint32_t epoch = node_get_script(map)->dyn->script.epoch;
+	int fd = epoch ? s->map->fd : s->map->fd1;
+	ssize_t n, i;
+
+	n = map_read_fd(s, fd, data);
+
+	for (i = 0; i < n; i++)
+		bpf_map_delete(fd, *data + i * rsize);
+
+	return n;
+}
+
+/* switch probes over to the other buffer of all double buffered
+ * maps, and wait for any probe still writing to the old one. */
+static void map_flip(node_t *script)
+{
+	uint32_t zero = 0, *epoch = &script->dyn->script.epoch;
+
+	if (!script->dyn->script.epochfd)
+		return;
+
+	*epoch ^= 1;
+	if (bpf_map_update(script->dyn->script.epochfd, &zero, epoch, 0)) {
+		_eno("unable to flip map buffers");
+		return;
+	}
+
+	/* probes run in rcu read-side critical sections. a global
+	 * membarrier waits for all of them to complete. its support
+	 * is checked before any map is double buffered. */
+	if (syscall(__NR_membarrier, MEMBARRIER_CMD_SHARED, 0))
+		_eno("unable to wait for probes, interval may be torn");
+}
+
+/* probes can not report failed updates, but a map that is full is
+ * the likely cause. lru maps make room instead. */
+static void map_check_full(sym_t *s, ssize_t n)
+{
+	if (s->map->full || n < (ssize_t)s->map->nelem)
+		return;
+
+#ifdef LINUX_HAS_LRU_MAPS
+	if (s->map->type == BPF_MAP_TYPE_LRU_HASH ||
+	    s->map->type == BPF_MAP_TYPE_LRU_PERCPU_HASH)
+		return;
+#endif
+
+	_w("%s: map is full, new entries are dropped", s->name);
+	s->map->full = 1;
+}
+
+void dump_map(node_t *map)
+{
+	sym_t *s = sym_from_node(map);
+	char *data, *out;
+	size_t rsize, nout;
+	ssize_t n;
+
+	rsize = s->map->ksize + s->map->vsize;
+
+	/* the buffer holds exactly what happened since the last
+	 * flip, no need to diff it. */
+	if (s->map->fd1) {
+		n = map_drain(map, s, &data);
+		map_check_full(s, n);
+		map_print(map, data, n < 0 ? 0 : n, rsize);
+		free(data);
+		return;
+	}
+
+	n = map_read(s, &data);
+	if (n < 0)
+		n = 0;
+
+	map_check_full(s, n);
+
+	if (G.interval && !G.cumulative && map->dyn->map.counters) {
+		out = map_delta(s, data, n, &nout);
+		map_print(map, out, nout, rsize);
+		free(out);
+		return;
+	}
+
+	map_print(map, data, n, rsize);
 	free(data);
 }
 
+int map_interval(node_t *script)
+{
+	char stamp[16];
+	time_t now;
+	sym_t *s;
+
+	map_flip(script);
+
+	/* workers (-j) and the async writer (-a) output events from
+	 * their own threads. they take the stdout lock around each
+	 * batch of whole lines, so holding it for the entire dump
+	 * keeps their output from ending up in the middle of it. */
+	flockfile(stdout);
+	fflush(stdout);
+
+	if (G.format == OUTPUT_TEXT) {
+		now = time(NULL);
+		strftime(stamp, sizeof(stamp), "%T", localtime(&now));
+		printf("\n[%s]\n", stamp);
+	}
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type == TYPE_MAP && s->name[0] == '@')
+			dump_map(s->map->map);
+	}
+
+	fflush(stdout);
+	funlockfile(stdout);
+	return 0;
+}
+
+static int map_mark_direct(node_t *n, void *_null)
+{
+	sym_t *s;
+
+	if (n->type != TYPE_MAP)
+		return 0;
+
+	if (n->parent && n->parent->type == TYPE_METHOD &&
+	    n->parent->method.map == n)
+		return 0;
+
+	s = sym_from_node(n);
+	if (s && s->type == TYPE_MAP)
+		s->map->direct = 1;
+
+	return 0;
+}
+
+static int map_setup_tops(node_t *script)
+{
+	char *spec, *eq;
+	sym_t *s;
+	int i;
+
+	for (i = 0; i < G.ntops; i++) {
+		spec = G.tops[i];
+		eq = strchr(spec, '=');
+
+		sym_foreach(s, script->dyn->script.st->syms) {
+			if (s->type == TYPE_MAP &&
+			    strlen(s->name) == (size_t)(eq - spec) &&
+			    !strncmp(s->name, spec, eq - spec))
+				break;
+		}
+
+		if (!s) {
+			_e("%.*s: no such map", (int)(eq - spec), spec);
+			return -ENOENT;
+		}
+
+		s->map->top = strtoul(eq + 1, NULL, 0);
+	}
+
+	return 0;
+}
+
+/* aggregations, i.e. maps only ever updated by methods, are never
+ * expired, they would silently lose counts. scratch maps,
+ * e.g. timestamps keyed by tid, are. */
+static int map_expires(sym_t *s)
+{
+	return s->name[0] == '@' && s->map->map && s->map->direct &&
+		!s->map->map->dyn->map.counters;
+}
+
+/* delete entries that have not changed since the previous sweep,
+ * i.e. that have been idle for at least one ttl. idle is judged by
+ * the value alone, an entry that is still needed but has not been
+ * rewritten, e.g. a pending start timestamp, is deleted too. best
+ * effort, an update that races with the sweep can be lost. */
+static void map_expire(sym_t *s)
+{
+	size_t ksize = s->map->ksize, rsize = ksize + s->map->vsize;
+	char *prev = s->map->seen, *pend = prev + s->map->nseen * rsize;
+	char *data, *cur, *out;
+	size_t expired = 0;
+	ssize_t n;
+
+	n = map_read(s, &data);
+	if (n < 0)
+		n = 0;
+
+	qsort_r(data, n, rsize, map_key_cmp, &ksize);
+
+	for (cur = out = data; cur < data + n * rsize; cur += rsize) {
+		for (; prev < pend && memcmp(prev, cur, ksize) < 0; prev += rsize);
+
+		if (prev < pend && !memcmp(prev, cur, rsize) &&
+		    !bpf_map_delete(s->map->fd, cur)) {
+			expired++;
+			continue;
+		}
+
+		memmove(out, cur, rsize);
+		out += rsize;
+	}
+
+	_d("%s: expired %zu of %zd entries", s->name, expired, n);
+
+	free(s->map->seen);
+	s->map->seen  = data;
+	s->map->nseen = (out - data) / rsize;
+}
+
+int map_sweep(node_t *script)
+{
+	sym_t *s;
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type == TYPE_MAP && s->map->fd >= 0 && map_expires(s))
+			map_expire(s);
+	}
+
+	return 0;
+}
+
+/* a flip is only safe if we can wait for all probes that might
+ * still be writing to the old buffer. MEMBARRIER_CMD_SHARED is not
+ * available on e.g. nohz_full systems, those fall back to diffing
+ * snapshots of a single buffer. */
+static int map_can_flip(void)
+{
+	static int can_flip = -1;
+	int cmds;
+
+	if (can_flip < 0) {
+		cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+		can_flip = (cmds > 0) && (cmds & MEMBARRIER_CMD_SHARED);
+		if (!can_flip)
+			_d("no membarrier, aggregations are not double buffered");
+	}
+
+	return can_flip;
+}
+
+/* aggregations printed as deltas are double buffered, so that each
+ * interval is read from a buffer that probes are no longer writing
+ * to, instead of diffing a torn view against the previous one. */
+static int map_double_buffered(sym_t *s)
+{
+#ifdef LINUX_HAS_MAP_VALUE
+	return G.interval && !G.cumulative && s->map->map &&
+		s->map->map->dyn->map.counters && !s->map->direct &&
+		map_can_flip();
+#else
+	return 0;
+#endif
+}
+
+static int map_setup_epoch(node_t *script, int *dumpfd)
+{
+	int fd;
+
+	if (G.dump) {
+		script->dyn->script.epochfd = (*dumpfd)++;
+		return 0;
+	}
+
+	fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+			    sizeof(uint32_t), 1);
+	if (fd < 0) {
+		_eno("epoch");
+		return -errno;
+	}
+
+	/* an epochfd of 0 means that there are no double buffered
+	 * maps, move it out of the way if stdin was closed. */
+	if (!fd) {
+		fd = fcntl(0, F_DUPFD_CLOEXEC, 1);
+		close(0);
+		if (fd < 0) {
+			_eno("epoch");
+			return -errno;
+		}
+	}
+
+	script->dyn->script.epochfd = fd;
+	return 0;
+}
+
+static int map_create(sym_t *s)
+{
+	int fd;
+
+	fd = bpf_map_create_flags(s->map->type, s->map->ksize,
+				  s->map->vsize, s->map->nelem, s->map->flags);
+#ifdef LINUX_HAS_LRU_MAPS
+	/* built with lru support, but running on an older kernel */
+	if (fd < 0 && errno == EINVAL &&
+	    (s->map->type == BPF_MAP_TYPE_LRU_HASH ||
+	     s->map->type == BPF_MAP_TYPE_LRU_PERCPU_HASH)) {
+		_w("%s: no lru maps in this kernel, "
+		   "entries are not evicted", s->name);
+
+		s->map->type = (s->map->type == BPF_MAP_TYPE_LRU_HASH) ?
+			BPF_MAP_TYPE_HASH : BPF_MAP_TYPE_PERCPU_HASH;
+		fd = bpf_map_create_flags(s->map->type, s->map->ksize,
+					  s->map->vsize, s->map->nelem,
+					  s->map->flags);
+	}
+#endif
+#ifdef BPF_F_NO_PREALLOC
+	/* same thing for maps that are only allocated on demand */
+	if (fd < 0 && errno == EINVAL && (s->map->flags & BPF_F_NO_PREALLOC)) {
+		_w("%s: no on-demand allocation in this kernel, "
+		   "preallocating %zu entries", s->name, s->map->nelem);
+
+		s->map->flags &= ~BPF_F_NO_PREALLOC;
+		fd = bpf_map_create_flags(s->map->type, s->map->ksize,
+					  s->map->vsize, s->map->nelem,
+					  s->map->flags);
+	}
+#endif
+	return fd;
+}
+
 int map_setup(node_t *script)
 {
 	int dumpfd = 0xfd00;
 	sym_t *s;
+	int err;
+
+	err = map_setup_tops(script);
+	if (err)
+		return err;
+
+	node_walk(script, NULL, map_mark_direct, NULL);
 
 	sym_foreach(s, script->dyn->script.st->syms) {
 		if (s->type != TYPE_MAP || s->map->fd >= 0)
 			continue;
 
+#ifdef LINUX_HAS_PERCPU_MAPS
+		/* counters that are only ever bumped by count() or
+		 * quantize() are kept per cpu, so that cpus do not
+		 * race for the same value. they are summed when the
+		 * map is read. */
+		if (s->map->map && s->map->map->dyn->map.counters &&
+		    !s->map->direct && s->map->type == BPF_MAP_TYPE_HASH)
+			s->map->type = BPF_MAP_TYPE_PERCPU_HASH;
+#endif
+
+#ifdef LINUX_HAS_LRU_MAPS
+		/* full maps make room for new entries by evicting the
+		 * least recently used ones, instead of refusing them. */
+		if (G.lru && s->map->type == BPF_MAP_TYPE_HASH)
+			s->map->type = BPF_MAP_TYPE_LRU_HASH;
+		else if (G.lru && s->map->type == BPF_MAP_TYPE_PERCPU_HASH)
+			s->map->type = BPF_MAP_TYPE_LRU_PERCPU_HASH;
+#else
+		if (G.lru && s->map->type == BPF_MAP_TYPE_HASH)
+			_w("%s: no lru maps in this kernel, "
+			   "entries are not evicted", s->name);
+#endif
+
+		if (map_double_buffered(s) && !script->dyn->script.epochfd) {
+			err = map_setup_epoch(script, &dumpfd);
+			if (err)
+				return err;
+		}
+
 		if (G.dump) {
 			s->map->fd = dumpfd++;
+			if (map_double_buffered(s))
+				s->map->fd1 = dumpfd++;
 			continue;
 		}
 
 		_d("%s: type:%d ksize:%#zx vsize:%#zx nelem:%#zx", s->name,
 		   s->map->type, s->map->ksize, s->map->vsize, s->map->nelem);
 
-		s->map->fd = bpf_map_create(s->map->type, s->map->ksize,
-					    s->map->vsize, s->map->nelem);
+		s->map->fd = map_create(s);
 		if (s->map->fd <= 0) {
 			_eno("%s", s->name);
 			return s->map->fd;
 		}
+
+		if (!map_double_buffered(s))
+			continue;
+
+		s->map->fd1 = map_create(s);
+		if (s->map->fd1 <= 0) {
+			_eno("%s", s->name);
+			return s->map->fd1;
+		}
 	}
 
 	return 0;
@@ -318,6 +988,8 @@ int map_teardown(node_t *script)
 	if (G.dump)
 		return 0;
 
+	map_flip(script);
+
 	sym_foreach(s, script->dyn->script.st->syms) {
 		if (s->type != TYPE_MAP || s->map->fd == -1)
 			continue;
@@ -327,6 +999,17 @@ int map_teardown(node_t *script)
 
 		close(s->map->fd);
 		s->map->fd = -1;
+
+		if (s->map->fd1) {
+			close(s->map->fd1);
+			s->map->fd1 = 0;
+		}
+
+		free(s->map->prev);
+		s->map->prev = NULL;
+
+		free(s->map->seen);
+		s->map->seen = NULL;
 	}
 
 	return 0;
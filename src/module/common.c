@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include <ply/ast.h>
+#include <ply/bpf-syscall.h>
 #include <ply/module.h>
 #include <ply/ply.h>
 
@@ -179,14 +180,36 @@ MODULE_FUNC(common, log2);
 static int common_mem_compile(node_t *call, prog_t *prog)
 {
 	node_t *addr = call->call.vargs;
+	node_t *len  = addr->next->next;
+	int func = BPF_FUNC_probe_read;
 
 	emit_stack_zero(prog, call);
 
 	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_1, call->dyn->addr));
-	emit(prog, MOV_IMM(BPF_REG_2, call->dyn->size));
+
+	if (len) {
+		emit_xfer_dyn(prog, &dyn_reg[BPF_REG_2], len);
+		emit_bound(prog, BPF_REG_2, call->dyn->size);
+		emit(prog, STXDW(BPF_REG_10, call->dyn->call.len, BPF_REG_2));
+	} else {
+		emit(prog, MOV_IMM(BPF_REG_2, call->dyn->size));
+	}
+
 	emit_xfer_dyn(prog, &dyn_reg[BPF_REG_3], addr);
-	emit(prog, CALL(BPF_FUNC_probe_read));
+
+#ifdef LINUX_HAS_VARLEN
+	/* stop at the terminator, the rest is left zeroed */
+	if (call->dyn->type == TYPE_STR)
+		func = BPF_FUNC_probe_read_str;
+#endif
+	emit(prog, CALL(func));
+
+#ifdef LINUX_HAS_VARLEN
+	/* the length of a string, including its terminator */
+	if (call->dyn->type == TYPE_STR)
+		emit(prog, STXDW(BPF_REG_10, call->dyn->call.len, BPF_REG_0));
+#endif
 
 	if (call->dyn->loc == LOC_REG) {
 		dyn_t src;
@@ -200,18 +223,25 @@ static int common_mem_compile(node_t *call, prog_t *prog)
 
 static int common_mem_loc_assign(node_t *call)
 {
-	node_t *probe;
+	node_t *probe = node_get_probe(call);
 
 	/* memory format is not needed by the kernel */
 	call->call.vargs->next->dyn->loc = LOC_VIRTUAL;
 
 	/* if the result is going to a register, allocate space on the
 	 * stack as a temporary location to probe_read to. */
-	if (call->dyn->loc == LOC_REG) {
-		probe = node_get_probe(call);
-
+	if (call->dyn->loc == LOC_REG)
 		call->dyn->addr = node_probe_stack_get(probe, call->dyn->size);
-	}
+
+	/* keep the number of bytes read around, so that consumers
+	 * like printf can avoid copying the rest. */
+	if (call->call.vargs->next->next
+#ifdef LINUX_HAS_VARLEN
+	    || call->dyn->type == TYPE_STR
+#endif
+		)
+		call->dyn->call.len = node_probe_stack_get(probe,
+							   sizeof(int64_t));
 
 	return default_loc_assign(call);
 }
@@ -323,8 +353,16 @@ static int common_mem_annotate(node_t *call)
 		return -EINVAL;
 
 	arg = arg->next;
-	if (arg)
-		return -EINVAL;
+	if (arg) {
+#ifdef LINUX_HAS_VARLEN
+		if (arg->dyn->type != TYPE_INT || arg->next)
+			return -EINVAL;
+#else
+		_e("%s: length argument requires linux 4.16 or later",
+		   node_str(call));
+		return -ENOSYS;
+#endif
+	}
 
 	return common_mem_infer(call);
 }
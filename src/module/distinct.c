@@ -0,0 +1,166 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+
+#include <ply/ast.h>
+#include <ply/map.h>
+#include <ply/module.h>
+#include <ply/ply.h>
+
+/* HyperLogLog. the value of each key is an array of 1 << HLL_BITS
+ * one byte registers. the top HLL_BITS of a value's hash select a
+ * register, which keeps the highest rank, i.e. the position of the
+ * first set bit, seen in the rest of the hash. the standard error
+ * of the estimate is 1.04 / sqrt(1 << HLL_BITS), ~9%. */
+#define HLL_BITS 7
+#define HLL_REGS (1 << HLL_BITS)
+
+static double distinct_estimate(const uint8_t *regs)
+{
+	double m = HLL_REGS, sum = 0.0, est;
+	int i, zeros = 0;
+
+	for (i = 0; i < HLL_REGS; i++) {
+		sum += 1.0 / (double)(1ULL << regs[i]);
+		zeros += !regs[i];
+	}
+
+	est = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+
+	/* small cardinalities are better estimated by the number of
+	 * registers that were never hit. */
+	if (est <= 2.5 * m && zeros)
+		est = m * log(m / zeros);
+
+	return est;
+}
+
+static int distinct_cmp(node_t *map, const void *ak, const void *bk)
+{
+	node_t *rec = map->map.rec;
+	double a = distinct_estimate(ak + rec->dyn->size);
+	double b = distinct_estimate(bk + rec->dyn->size);
+
+	if (a != b)
+		return (a < b) ? -1 : 1;
+
+	return cmp_node(rec, ak, bk);
+}
+
+static void distinct_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	node_t *rec = map->map.rec;
+	size_t rsize = rec->dyn->size + map->dyn->size;
+
+	for (; len > 0; len--, data += rsize) {
+		dump_node(fp, rec, data);
+		fprintf(fp, "\t%8.0f\n", distinct_estimate(data + rec->dyn->size));
+	}
+}
+
+/* the murmur3 finalizer, every input bit affects every output bit */
+static void distinct_emit_hash(prog_t *prog, int reg, int tmp)
+{
+	emit(prog, MOV(tmp, reg));
+	emit(prog, ALU_IMM(BPF_RSH, tmp, 33));
+	emit(prog, ALU(BPF_XOR, reg, tmp));
+	emit_ld_imm64(prog, tmp, 0xff51afd7ed558ccdULL);
+	emit(prog, ALU(BPF_MUL, reg, tmp));
+	emit(prog, MOV(tmp, reg));
+	emit(prog, ALU_IMM(BPF_RSH, tmp, 33));
+	emit(prog, ALU(BPF_XOR, reg, tmp));
+	emit_ld_imm64(prog, tmp, 0xc4ceb9fe1a85ec53ULL);
+	emit(prog, ALU(BPF_MUL, reg, tmp));
+	emit(prog, MOV(tmp, reg));
+	emit(prog, ALU_IMM(BPF_RSH, tmp, 33));
+	emit(prog, ALU(BPF_XOR, reg, tmp));
+}
+
+static int distinct_compile(node_t *call, prog_t *prog)
+{
+	node_t *map = call->parent->method.map;
+	node_t *num = call->call.vargs;
+	struct bpf_insn *full;
+
+	emit_map_lookup_or_insert(prog, map);
+	full = prog->ip;
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+	emit(prog, MOV(BPF_REG_4, BPF_REG_0));
+
+	emit_xfer_dyn(prog, &dyn_reg[BPF_REG_1], num);
+	distinct_emit_hash(prog, BPF_REG_1, BPF_REG_2);
+
+	/* r4 = &regs[hash >> (64 - HLL_BITS)] */
+	emit(prog, MOV(BPF_REG_3, BPF_REG_1));
+	emit(prog, ALU_IMM(BPF_RSH, BPF_REG_3, 64 - HLL_BITS));
+	emit(prog, ALU(BPF_ADD, BPF_REG_4, BPF_REG_3));
+
+	/* the rank is the number of leading zeros + 1 in the rest of
+	 * the hash. a sentinel bit bounds it, and the shift keeps
+	 * the value positive for log2. */
+	emit(prog, ALU_IMM(BPF_LSH, BPF_REG_1, HLL_BITS));
+	emit(prog, ALU_IMM(BPF_OR, BPF_REG_1, 1 << (HLL_BITS - 1)));
+	emit(prog, ALU_IMM(BPF_RSH, BPF_REG_1, 1));
+	emit_log2_raw(prog, BPF_REG_2, BPF_REG_1);
+	emit(prog, MOV_IMM(BPF_REG_1, 64));
+	emit(prog, ALU(BPF_SUB, BPF_REG_1, BPF_REG_2));
+
+	/* registers only ever grow */
+	emit(prog, LDXB(BPF_REG_2, 0, BPF_REG_4));
+	emit(prog, JMP(BPF_JGE, BPF_REG_2, BPF_REG_1, 1));
+	emit(prog, STXB(BPF_REG_4, 0, BPF_REG_1));
+
+	emit_at(prog, full, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, prog->ip - full - 1));
+	return 0;
+}
+
+static int distinct_loc_assign(node_t *call)
+{
+	node_t *map = call->parent->method.map;
+
+	map->dyn->map.dump = distinct_dump;
+	map->dyn->map.cmp = distinct_cmp;
+	call->dyn->call.inplace = 1;
+	return default_loc_assign(call);
+}
+
+static int distinct_annotate(node_t *call)
+{
+	node_t *num = call->call.vargs;
+
+	if (call->parent->type != TYPE_METHOD || !num || num->next ||
+	    (num->dyn->type != TYPE_NONE && num->dyn->type != TYPE_INT))
+		return -EINVAL;
+
+	/* the registers are opaque, only the estimate is printed */
+	call->dyn->type = TYPE_NONE;
+	call->dyn->size = HLL_REGS;
+	return 0;
+}
+
+const func_t distinct_func = {
+	.name = "distinct",
+
+	.compile = distinct_compile,
+	.loc_assign = distinct_loc_assign,
+	.annotate = distinct_annotate,
+};
@@ -19,6 +19,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -31,10 +32,9 @@ static int method_count_compile(node_t *call, prog_t *prog)
 {
 	node_t *map = call->parent->method.map;
 
-	emit(prog, LDXDW(BPF_REG_0, map->dyn->addr, BPF_REG_10));
-	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_0, 1));
+	emit(prog, MOV_IMM(BPF_REG_0, 1));
 	emit(prog, STXDW(BPF_REG_10, map->dyn->addr, BPF_REG_0));
-	return 0;
+	return emit_map_xadd(prog, map);
 }
 
 static int method_count_cmp(node_t *map, const void *ak, const void *bk)
@@ -57,6 +57,8 @@ static int method_count_loc_assign(node_t *call)
 	node_t *map = call->parent->method.map;
 
 	map->dyn->map.cmp = method_count_cmp;
+	map->dyn->map.counters = 1;
+	call->dyn->call.inplace = 1;
 	return default_loc_assign(call);
 }
 
@@ -73,11 +75,287 @@ static int method_count_annotate(node_t *call)
 }
 MODULE_FUNC_LOC(method, count);
 
+/* methods aggregating a single integer expression. the value is
+ * built on the stack, from one or more copies of the expression,
+ * and then merged into the map entry in place. */
+static int method_stat_annotate(node_t *call, size_t size)
+{
+	node_t *num = call->call.vargs;
+
+	if (call->parent->type != TYPE_METHOD || !num || num->next ||
+	    (num->dyn->type != TYPE_NONE && num->dyn->type != TYPE_INT))
+		return -EINVAL;
+
+	call->dyn->type = (size == sizeof(int64_t)) ? TYPE_INT : TYPE_NONE;
+	call->dyn->size = size;
+	return 0;
+}
+
+/* store n copies of the expression, the first one is replaced by
+ * a count of 1 if count is set. */
+static void method_stat_store(prog_t *prog, node_t *call, int count, int n)
+{
+	node_t *map = call->parent->method.map;
+	ssize_t addr = map->dyn->addr;
+	int i;
+
+	emit_xfer_dyn(prog, &dyn_reg[BPF_REG_0], call->call.vargs);
+	for (i = 0; i < n; i++)
+		emit(prog, STXDW(BPF_REG_10, addr + i * sizeof(int64_t), BPF_REG_0));
+
+	if (count) {
+		emit(prog, MOV_IMM(BPF_REG_0, 1));
+		emit(prog, STXDW(BPF_REG_10, addr, BPF_REG_0));
+	}
+}
+
+static void method_emit_xadd(prog_t *prog, ssize_t val, int off)
+{
+	emit(prog, LDXDW(BPF_REG_1, val + off, BPF_REG_10));
+	emit(prog, XADDDW(BPF_REG_0, off, BPF_REG_1));
+}
+
+/* not atomic, a concurrent update of the same entry on another cpu
+ * can be lost. */
+static void method_emit_min(prog_t *prog, ssize_t val, int off)
+{
+	emit(prog, LDXDW(BPF_REG_1, val + off, BPF_REG_10));
+	emit(prog, LDXDW(BPF_REG_2, off, BPF_REG_0));
+	emit(prog, JMP(BPF_JSGE, BPF_REG_1, BPF_REG_2, 1));
+	emit(prog, STXDW(BPF_REG_0, off, BPF_REG_1));
+}
+
+static void method_emit_max(prog_t *prog, ssize_t val, int off)
+{
+	emit(prog, LDXDW(BPF_REG_1, val + off, BPF_REG_10));
+	emit(prog, LDXDW(BPF_REG_2, off, BPF_REG_0));
+	emit(prog, JMP(BPF_JSGE, BPF_REG_2, BPF_REG_1, 1));
+	emit(prog, STXDW(BPF_REG_0, off, BPF_REG_1));
+}
+
+static int method_stat_loc_assign(node_t *call, cmper_t cmp, mdumper_t dump,
+				  const char *const *words, int counters)
+{
+	node_t *map = call->parent->method.map;
+
+	map->dyn->map.cmp = cmp;
+	map->dyn->map.dump = dump;
+	map->dyn->map.words = words;
+	map->dyn->map.counters = counters;
+	call->dyn->call.inplace = 1;
+	return default_loc_assign(call);
+}
+
+static int method_sum_compile(node_t *call, prog_t *prog)
+{
+	method_stat_store(prog, call, 0, 1);
+	return emit_map_xadd(prog, call->parent->method.map);
+}
+
+static int method_sum_loc_assign(node_t *call)
+{
+	return method_stat_loc_assign(call, method_count_cmp, NULL, NULL, 1);
+}
+
+static int method_sum_annotate(node_t *call)
+{
+	return method_stat_annotate(call, sizeof(int64_t));
+}
+MODULE_FUNC_LOC(method, sum);
+
+static void method_min_update(prog_t *prog, ssize_t val)
+{
+	method_emit_min(prog, val, 0);
+}
+
+static int method_min_compile(node_t *call, prog_t *prog)
+{
+	method_stat_store(prog, call, 0, 1);
+	return emit_map_inplace(prog, call->parent->method.map,
+				method_min_update);
+}
+
+static int method_min_loc_assign(node_t *call)
+{
+	return method_stat_loc_assign(call, method_count_cmp, NULL, NULL, 0);
+}
+
+static int method_min_annotate(node_t *call)
+{
+	return method_stat_annotate(call, sizeof(int64_t));
+}
+MODULE_FUNC_LOC(method, min);
+
+static void method_max_update(prog_t *prog, ssize_t val)
+{
+	method_emit_max(prog, val, 0);
+}
+
+static int method_max_compile(node_t *call, prog_t *prog)
+{
+	method_stat_store(prog, call, 0, 1);
+	return emit_map_inplace(prog, call->parent->method.map,
+				method_max_update);
+}
+
+static int method_max_loc_assign(node_t *call)
+{
+	return method_stat_loc_assign(call, method_count_cmp, NULL, NULL, 0);
+}
+
+static int method_max_annotate(node_t *call)
+{
+	return method_stat_annotate(call, sizeof(int64_t));
+}
+MODULE_FUNC_LOC(method, max);
+
+/* avg() and stats() values start with these, a count followed by
+ * the sum. */
+struct method_stats {
+	int64_t count;
+	int64_t sum;
+	int64_t min;
+	int64_t max;
+};
+
+static const char *const method_avg_words[] = { "count", "sum", NULL };
+static const char *const method_stats_words[] = {
+	"count", "sum", "min", "max", NULL
+};
+
+static int64_t method_stats_avg(const struct method_stats *st)
+{
+	return st->count ? st->sum / st->count : 0;
+}
+
+static int method_avg_cmp(node_t *map, const void *ak, const void *bk)
+{
+	node_t *rec = map->map.rec;
+	struct method_stats a = { 0 }, b = { 0 };
+
+	memcpy(&a, ak + rec->dyn->size, map->dyn->size);
+	memcpy(&b, bk + rec->dyn->size, map->dyn->size);
+
+	if (method_stats_avg(&a) != method_stats_avg(&b))
+		return (method_stats_avg(&a) < method_stats_avg(&b)) ? -1 : 1;
+
+	return cmp_node(rec, ak, bk);
+}
+
+static void method_avg_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	node_t *rec = map->map.rec;
+	size_t rsize = rec->dyn->size + map->dyn->size;
+	struct method_stats st = { 0 };
+
+	for (; len > 0; len--, data += rsize) {
+		memcpy(&st, data + rec->dyn->size, map->dyn->size);
+
+		dump_node(fp, rec, data);
+		fprintf(fp, "\t%8" PRId64 "\n", method_stats_avg(&st));
+	}
+}
+
+static void method_avg_update(prog_t *prog, ssize_t val)
+{
+	method_emit_xadd(prog, val, offsetof(struct method_stats, count));
+	method_emit_xadd(prog, val, offsetof(struct method_stats, sum));
+}
+
+static int method_avg_compile(node_t *call, prog_t *prog)
+{
+	method_stat_store(prog, call, 1, 2);
+	return emit_map_inplace(prog, call->parent->method.map,
+				method_avg_update);
+}
+
+static int method_avg_loc_assign(node_t *call)
+{
+	return method_stat_loc_assign(call, method_avg_cmp, method_avg_dump,
+				      method_avg_words, 1);
+}
+
+static int method_avg_annotate(node_t *call)
+{
+	return method_stat_annotate(call, 2 * sizeof(int64_t));
+}
+MODULE_FUNC_LOC(method, avg);
+
+static int method_stats_cmp(node_t *map, const void *ak, const void *bk)
+{
+	node_t *rec = map->map.rec;
+	struct method_stats a, b;
+
+	memcpy(&a, ak + rec->dyn->size, sizeof(a));
+	memcpy(&b, bk + rec->dyn->size, sizeof(b));
+
+	if (a.count != b.count)
+		return (a.count < b.count) ? -1 : 1;
+
+	return cmp_node(rec, ak, bk);
+}
+
+static void method_stats_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	node_t *rec = map->map.rec;
+	size_t rsize = rec->dyn->size + map->dyn->size;
+	struct method_stats st;
+
+	for (; len > 0; len--, data += rsize) {
+		memcpy(&st, data + rec->dyn->size, sizeof(st));
+
+		dump_node(fp, rec, data);
+		fprintf(fp, "\tcount %8" PRId64 "  sum %8" PRId64
+			"  min %8" PRId64 "  max %8" PRId64 "  avg %8" PRId64 "\n",
+			st.count, st.sum, st.min, st.max, method_stats_avg(&st));
+	}
+}
+
+static void method_stats_update(prog_t *prog, ssize_t val)
+{
+	method_emit_xadd(prog, val, offsetof(struct method_stats, count));
+	method_emit_xadd(prog, val, offsetof(struct method_stats, sum));
+	method_emit_min(prog, val, offsetof(struct method_stats, min));
+	method_emit_max(prog, val, offsetof(struct method_stats, max));
+}
+
+static int method_stats_compile(node_t *call, prog_t *prog)
+{
+	method_stat_store(prog, call, 1, 4);
+	return emit_map_inplace(prog, call->parent->method.map,
+				method_stats_update);
+}
+
+/* min and max can not be summed, so unlike avg() the map is neither
+ * kept per cpu nor printed as deltas. */
+static int method_stats_loc_assign(node_t *call)
+{
+	return method_stat_loc_assign(call, method_stats_cmp, method_stats_dump,
+				      method_stats_words, 0);
+}
+
+static int method_stats_annotate(node_t *call)
+{
+	return method_stat_annotate(call, sizeof(struct method_stats));
+}
+MODULE_FUNC_LOC(method, stats);
+
 extern const func_t quantize_func;
+extern const func_t lhist_func;
+extern const func_t quantiles_func;
+extern const func_t distinct_func;
 
 static const func_t *method_funcs[] = {
 	&method_count_func,
+	&method_sum_func,
+	&method_min_func,
+	&method_max_func,
+	&method_avg_func,
+	&method_stats_func,
 	&quantize_func,
+	&lhist_func,
+	&quantiles_func,
+	&distinct_func,
 	NULL
 };
 
@@ -29,118 +29,530 @@
 #include <ply/evpipe.h>
 #include <ply/map.h>
 #include <ply/module.h>
+#include <ply/output.h>
 #include <ply/ply.h>
 
-static void printf_num(const char *fmt, const char *term, int64_t num)
+/* format strings are parsed once, into a list of literal spans and
+ * conversions that are rendered for each event. */
+enum printf_op_type {
+	PRINTF_LIT,
+	PRINTF_INT,
+	PRINTF_CHR,
+	PRINTF_STR,
+	PRINTF_NODE,
+	PRINTF_FMT,
+};
+
+struct printf_op {
+	enum printf_op_type type;
+
+	/* PRINTF_LIT */
+	const char *lit;
+	size_t      len;
+
+	/* conversions */
+	node_t *arg;
+	char   *fmt;
+	char    conv;
+	char    mod;
+	int     bits;
+	int     width;
+	unsigned int left:1;
+	unsigned int zero:1;
+};
+
+/* the event type is kept in the upper half of the record's first
+ * word, the lower half is never sent. */
+#define PRINTF_SKIP (sizeof(uint64_t) - sizeof(uint32_t))
+
+struct printf_plan {
+	node_t *rec;
+	oenc_t *enc;
+
+	int nops;
+	struct printf_op ops[0];
+};
+
+static void printf_int(obuf_t *pb, struct printf_op *op,
+		       int64_t num)
 {
-	switch (*(term - 1)) {
-	case 'h':
-		if (*(term - 2) == 'h')
-			printf(fmt, (char)num);
+	char buf[24], *end = buf + sizeof(buf), *str;
+	int neg = 0, len;
+	uint64_t v;
+
+	/* truncate and extend according to the length modifier, as
+	 * if the value had been passed through the C type. */
+	if (op->bits < 64) {
+		if (op->conv == 'd' || op->conv == 'i')
+			num = (int64_t)((uint64_t)num << (64 - op->bits))
+				>> (64 - op->bits);
 		else
-			printf(fmt, (short)num);
-		break;
+			num &= (1ULL << op->bits) - 1;
+	}
+
+	v = num;
+	if ((op->conv == 'd' || op->conv == 'i') && num < 0) {
+		neg = 1;
+		v = -(uint64_t)num;
+	}
+
+	str = obuf_utoa(end, v, op->conv);
+	len = (end - str) + neg;
+
+	if (op->left) {
+		if (neg)
+			obuf_put(pb, "-", 1);
+		obuf_put(pb, str, end - str);
+		obuf_pad(pb, ' ', op->width - len);
+	} else if (op->zero) {
+		if (neg)
+			obuf_put(pb, "-", 1);
+		obuf_pad(pb, '0', op->width - len);
+		obuf_put(pb, str, end - str);
+	} else {
+		obuf_pad(pb, ' ', op->width - len);
+		if (neg)
+			obuf_put(pb, "-", 1);
+		obuf_put(pb, str, end - str);
+	}
+}
+
+static int printf_fmt_num(char *buf, size_t size, struct printf_op *op,
+			  int64_t num)
+{
+	switch (op->mod) {
+	case 'H':
+		return snprintf(buf, size, op->fmt, (char)num);
+	case 'h':
+		return snprintf(buf, size, op->fmt, (short)num);
 	case 'j':
-		printf(fmt, (intmax_t)num);
-		break;
+		return snprintf(buf, size, op->fmt, (intmax_t)num);
+	case 'L':
+		return snprintf(buf, size, op->fmt, (long long int)num);
 	case 'l':
-		if (*(term - 2) == 'l')
-			printf(fmt, (long long int)num);
-		else
-			printf(fmt, (long int)num);
-		break;
+		return snprintf(buf, size, op->fmt, (long int)num);
 	case 't':
-		printf(fmt, (ptrdiff_t)num);
-		break;
+		return snprintf(buf, size, op->fmt, (ptrdiff_t)num);
 	case 'z':
-		printf(fmt, (size_t)num);
+		return snprintf(buf, size, op->fmt, (size_t)num);
+	default:
+		return snprintf(buf, size, op->fmt, (int)num);
+	}
+}
+
+static int printf_fmt_one(char *buf, size_t size, struct printf_op *op,
+			  void *data, int64_t num)
+{
+	switch (op->conv) {
+	case 's':
+		return snprintf(buf, size, op->fmt, (char *)data);
+	case 'c':
+		return snprintf(buf, size, op->fmt, (char)num);
+	case 'p':
+		return snprintf(buf, size, op->fmt, (void *)(uintptr_t)num);
+	default:
+		return printf_fmt_num(buf, size, op, num);
+	}
+}
+
+/* anything but the common cases is left to the C library */
+static void printf_fmt(obuf_t *pb, struct printf_op *op,
+		       void *data, int64_t num)
+{
+	size_t room = sizeof(pb->data) - pb->len;
+	int len;
+
+	len = printf_fmt_one(pb->data + pb->len, room, op, data, num);
+	if (len < 0)
+		return;
+
+	if (len < room) {
+		pb->len += len;
+		return;
+	}
+
+	obuf_flush(pb);
+	if (len < sizeof(pb->data)) {
+		pb->len = printf_fmt_one(pb->data, sizeof(pb->data),
+					 op, data, num);
+		return;
+	}
+
+	switch (op->conv) {
+	case 's':
+		fprintf(pb->fp, op->fmt, (char *)data);
 		break;
 	default:
-		printf(fmt, (int)num);
+		/* no single number is this wide */
 		break;
 	}
 }
 
-static void printf_spec(const char *spec, const char *term, void *data,
-			node_t *arg)
+static int printf_event(FILE *fp, event_t *ev, size_t size, void *_plan)
 {
+	struct printf_plan *plan = _plan;
+	size_t full = plan->rec->dyn->size - PRINTF_SKIP;
+	uint64_t buf[64];
+	obuf_t pb;
+	struct printf_op *op;
+	void *data;
 	int64_t num;
-	size_t fmt_len;
-	char *fmt;
+	char c;
 
-	/* copy, don't cast. we could be on a platform that does not
-	 * handle unaligned accesses */
-	memcpy(&num, data, sizeof(num));
+	if (size > full)
+		size = full;
 
-	fmt_len = term - spec + 1;
-	fmt = strndup(spec, fmt_len);
+	if (G.format == OUTPUT_BINARY)
+		return output_event(fp, plan->enc, ev, size);
 
-	switch (*term) {
-	case 's':
-		printf(fmt, (char *)data);
+	/* the last argument may have been cut short by the kernel,
+	 * restore the zeroes that were never sent. */
+	if (size < full) {
+		assert(full <= sizeof(buf));
+		memcpy(buf, ev, size);
+		memset((void *)buf + size, 0, full - size);
+		ev = (void *)buf;
+	}
+
+	if (G.format != OUTPUT_TEXT)
+		return output_event(fp, plan->enc, ev, full);
+
+	data = ev->data;
+	pb.fp  = fp;
+	pb.len = 0;
+
+	for (op = plan->ops; op < &plan->ops[plan->nops]; op++) {
+		if (op->type == PRINTF_LIT) {
+			obuf_put(&pb, op->lit, op->len);
+			continue;
+		}
+
+		/* copy, don't cast. we could be on a platform that does
+		 * not handle unaligned accesses */
+		memcpy(&num, data, sizeof(num));
+
+		switch (op->type) {
+		case PRINTF_INT:
+			printf_int(&pb, op, num);
+			break;
+		case PRINTF_CHR:
+			if (!op->left)
+				obuf_pad(&pb, ' ', op->width - 1);
+			c = num;
+			obuf_put(&pb, &c, 1);
+			if (op->left)
+				obuf_pad(&pb, ' ', op->width - 1);
+			break;
+		case PRINTF_STR:
+			obuf_put(&pb, data,
+				       strnlen(data, op->arg->dyn->size));
+			break;
+		case PRINTF_NODE:
+			obuf_flush(&pb);
+			dump_node(fp, op->arg, data);
+			break;
+		case PRINTF_FMT:
+			printf_fmt(&pb, op, data, num);
+			break;
+		default:
+			break;
+		}
+
+		data += op->arg->dyn->size;
+	}
+
+	obuf_flush(&pb);
+	return 0;
+}
+
+static int printf_bits(char mod)
+{
+	switch (mod) {
+	case 'H': return sizeof(char) * 8;
+	case 'h': return sizeof(short) * 8;
+	case 'j': return sizeof(intmax_t) * 8;
+	case 'L': return sizeof(long long int) * 8;
+	case 'l': return sizeof(long int) * 8;
+	case 't': return sizeof(ptrdiff_t) * 8;
+	case 'z': return sizeof(size_t) * 8;
+	default:  return sizeof(int) * 8;
+	}
+}
+
+/* parse the conversion starting at spec, which points to the '%' */
+static const char *printf_parse_spec(const char *spec, struct printf_op *op)
+{
+	const char *c = spec + 1;
+	int fast = 1;
+
+	for (;; c++) {
+		if (*c == '-')
+			op->left = 1;
+		else if (*c == '0')
+			op->zero = 1;
+		else if (*c == '+' || *c == ' ' || *c == '#')
+			fast = 0;
+		else
+			break;
+	}
+
+	for (; *c >= '0' && *c <= '9'; c++)
+		op->width = op->width * 10 + (*c - '0');
+
+	if (*c == '.') {
+		fast = 0;
+		for (c++; *c >= '0' && *c <= '9'; c++);
+	}
+
+	if (*c == '*')
+		return NULL;
+
+	switch (*c) {
+	case 'h':
+	case 'l':
+		op->mod = *c++;
+		if (*c == op->mod) {
+			op->mod = (op->mod == 'h') ? 'H' : 'L';
+			c++;
+		}
 		break;
-	case 'v':
-		dump_node(stdout, arg, data);
+	case 'j':
+	case 't':
+	case 'z':
+		op->mod = *c++;
 		break;
+	}
+
+	if (!*c || !strchr("cdiopsuvxX", *c))
+		return NULL;
+
+	op->conv = *c;
+	op->bits = printf_bits(op->mod);
+
+	switch (op->conv) {
 	case 'c':
-		printf(fmt, (char)num);
+		op->type = fast ? PRINTF_CHR : PRINTF_FMT;
+		break;
+	case 's':
+		op->type = (fast && !op->width) ? PRINTF_STR : PRINTF_FMT;
+		break;
+	case 'v':
+		op->type = PRINTF_NODE;
 		break;
 	case 'p':
-		printf(fmt, (uintptr_t)num);
+		op->type = PRINTF_FMT;
 		break;
-	case 'i':
-	case 'd':
-	case 'o':
-	case 'u':
-	case 'x':
-	case 'X':
-		printf_num(fmt, term, num);
+	default:
+		op->type = fast ? PRINTF_INT : PRINTF_FMT;
 		break;
 	}
 
-	free(fmt);
+	if (op->type == PRINTF_FMT) {
+		op->fmt = strndup(spec, c - spec + 1);
+		assert(op->fmt);
+	}
+
+	return c;
 }
 
-static int printf_event(event_t *ev, void *_call)
+static struct printf_plan *printf_plan_new(node_t *call, node_t *arg)
 {
-	node_t *arg, *call = _call;
-	char *fmt, *spec;
-	void *data = ev->data;
-
-	arg  = call->call.vargs->next->rec.vargs->next;
-	for (fmt = call->call.vargs->string; *fmt; fmt++) {
-		if (*fmt == '%' && arg) {
-			spec = fmt;
-			fmt = strpbrk(spec, "cdiopsuvxX");
-			if (!fmt)
-				break;
-
-			printf_spec(spec, fmt, data, arg);
-			data += arg->dyn->size;
-			arg = arg->next;
-		} else {
-			fputc(*fmt, stdout);
+	struct printf_plan *plan;
+	struct printf_op *op;
+	node_t *args = arg;
+	const char *fmt, *lit;
+	size_t nops;
+
+	/* at most one literal span and one conversion per '%' */
+	fmt = call->call.vargs->string;
+	for (nops = 1, lit = fmt; (lit = strchr(lit, '%')); lit++, nops += 2);
+
+	plan = calloc(1, sizeof(*plan) + nops * sizeof(*op));
+	assert(plan);
+
+	op = plan->ops;
+	for (lit = fmt; *fmt; ) {
+		if (*fmt != '%') {
+			fmt++;
+			continue;
 		}
+
+		/* "%%" is collapsed even when the arguments have run
+		 * out, any other conversion is then output as is. */
+		if (fmt[1] == '%') {
+			/* include the first '%' in the literal span */
+			op->type = PRINTF_LIT;
+			op->lit  = lit;
+			op->len  = fmt + 1 - lit;
+			op++;
+
+			fmt += 2;
+			lit = fmt;
+			continue;
+		}
+
+		if (!arg) {
+			fmt++;
+			continue;
+		}
+
+		if (fmt > lit) {
+			op->type = PRINTF_LIT;
+			op->lit  = lit;
+			op->len  = fmt - lit;
+			op++;
+		}
+
+		fmt = printf_parse_spec(fmt, op);
+		if (!fmt) {
+			_e("invalid conversion in format string of %s",
+			   node_str(call));
+			free(plan);
+			return NULL;
+		}
+
+		op->arg = arg;
+		arg = arg->next;
+		op++;
+
+		lit = ++fmt;
 	}
 
-	return 0;
+	if (fmt > lit) {
+		op->type = PRINTF_LIT;
+		op->lit  = lit;
+		op->len  = fmt - lit;
+		op++;
+	}
+
+	plan->nops = op - plan->ops;
+	plan->enc  = oenc_new(NULL, args, NULL);
+	return plan;
+}
+
+#ifdef LINUX_HAS_VARLEN
+/* the last argument of the record, if its captured length is only
+ * known at run time. */
+static node_t *printf_varlen(node_t *rec, ssize_t *addr)
+{
+	node_t *meta = rec->rec.vargs, *last;
+
+	*addr = rec->dyn->addr;
+	for (last = meta; last->next; last = last->next)
+		*addr += last->dyn->size;
+
+	if (last == meta)
+		return NULL;
+
+	if (last->type == TYPE_CALL && last->dyn->call.len)
+		return last;
+
+	if (last->dyn->type == TYPE_STR)
+		return last;
+
+	return NULL;
+}
+
+/* strings whose length was not recorded when they were captured are
+ * measured with an unrolled scan, up to this size. */
+#define PRINTF_SCAN_MAX 64
+
+/* leave the number of bytes to send in r0, clobbers r1-r5 */
+static void printf_emit_size(prog_t *prog, node_t *rec)
+{
+	ssize_t addr, i;
+	node_t *last;
+
+	last = printf_varlen(rec, &addr);
+	if (!last) {
+		emit(prog, MOV_IMM(BPF_REG_0, rec->dyn->size - PRINTF_SKIP));
+		return;
+	}
+
+	if (last->type == TYPE_CALL && last->dyn->call.len) {
+		emit(prog, LDXDW(BPF_REG_0, last->dyn->call.len, BPF_REG_10));
+	} else if (last->dyn->size <= PRINTF_SCAN_MAX) {
+		/* find the first terminator, scanning backwards, the
+		 * result includes it. */
+		emit(prog, MOV_IMM(BPF_REG_0, last->dyn->size));
+		for (i = last->dyn->size - 1; i >= 0; i--) {
+			emit(prog, LDXB(BPF_REG_1, addr + i, BPF_REG_10));
+			emit(prog, JMP_IMM(BPF_JNE, BPF_REG_1, 0, 1));
+			emit(prog, MOV_IMM(BPF_REG_0, i + 1));
+		}
+	} else {
+		/* too long to scan, send all of it */
+		emit(prog, MOV_IMM(BPF_REG_0, last->dyn->size));
+	}
+
+	emit_bound(prog, BPF_REG_0, last->dyn->size);
+	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_0,
+			   addr - (rec->dyn->addr + PRINTF_SKIP)));
 }
+#endif
 
 int printf_compile(node_t *call, prog_t *prog)
 {
 	node_t *script = node_get_script(call);
 	node_t *rec = call->call.vargs->next;
+	evpipe_t *evp = script->dyn->script.evp;
+
+#ifdef LINUX_HAS_RINGBUF
+	if (evp->ringbuf) {
+		printf_emit_size(prog, rec);
+		emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+
+		emit_ld_mapfd(prog, BPF_REG_1, evp->mapfd);
 
+		emit(prog, MOV(BPF_REG_2, BPF_REG_10));
+		emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2,
+				   rec->dyn->addr + PRINTF_SKIP));
+
+		/* batched wakeups are emulated by never waking up the
+		 * reader, the latency timer will pick the events up. */
+		emit(prog, MOV_IMM(BPF_REG_4,
+				   (G.wakeup_bytes || G.wakeup_events > 1) ?
+				   BPF_RB_NO_WAKEUP : 0));
+		emit(prog, CALL(BPF_FUNC_ringbuf_output));
+
+		/* the ring was full, count the drop on this cpu. the
+		 * type word of the record is no longer needed and is
+		 * reused for the key. */
+		emit(prog, JMP_IMM(BPF_JSGE, BPF_REG_0, 0, 10));
+		emit(prog, CALL(BPF_FUNC_get_smp_processor_id));
+		emit(prog, STXW(BPF_REG_10, rec->dyn->addr + PRINTF_SKIP,
+				BPF_REG_0));
+		emit_ld_mapfd(prog, BPF_REG_1, evp->lostfd);
+		emit(prog, MOV(BPF_REG_2, BPF_REG_10));
+		emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2,
+				   rec->dyn->addr + PRINTF_SKIP));
+		emit(prog, CALL(BPF_FUNC_map_lookup_elem));
+		emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2));
+		emit(prog, MOV_IMM(BPF_REG_1, 1));
+		emit(prog, XADDDW(BPF_REG_0, 0, BPF_REG_1));
+		return 0;
+	}
+#endif
+
+#ifdef LINUX_HAS_VARLEN
+	printf_emit_size(prog, rec);
+	emit(prog, MOV(BPF_REG_5, BPF_REG_0));
+
+	/* BPF_F_CURRENT_CPU, without sign extending the immediate */
+	emit(prog, MOV_IMM(BPF_REG_3, -1));
+	emit(prog, ALU_IMM(BPF_RSH, BPF_REG_3, 32));
+#else
 	emit(prog, CALL(BPF_FUNC_get_smp_processor_id));
 	emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+	emit(prog, MOV_IMM(BPF_REG_5, rec->dyn->size - PRINTF_SKIP));
+#endif
 
 	emit(prog, MOV(BPF_REG_1, BPF_REG_9));
-	emit_ld_mapfd(prog, BPF_REG_2, script->dyn->script.evp->mapfd);
+	emit_ld_mapfd(prog, BPF_REG_2, evp->mapfd);
 
 	emit(prog, MOV(BPF_REG_4, BPF_REG_10));
-	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_4, rec->dyn->addr));
+	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_4, rec->dyn->addr + PRINTF_SKIP));
 
-	emit(prog, MOV_IMM(BPF_REG_5, rec->dyn->size));
 	emit(prog, CALL(BPF_FUNC_perf_event_output));
 	return 0;
 }
@@ -163,6 +575,7 @@ int printf_loc_assign(node_t *call)
 
 int printf_annotate(node_t *call)
 {
+	struct printf_plan *plan;
 	evhandler_t *evh;
 	node_t *meta, *rec, *varg;
 
@@ -180,19 +593,31 @@ int printf_annotate(node_t *call)
 	evh = calloc(1, sizeof(*evh));
 	assert(evh);
 
-	evh->priv = call;
+	plan = printf_plan_new(call, varg->next);
+	if (!plan) {
+		free(evh);
+		return -EINVAL;
+	}
+
+	evh->priv = plan;
+	evh->desc = varg->string;
 	evh->handle = printf_event;
 	evhandler_register(evh);
 
 	/* rewrite printf("a:%d b:%d", a(), b())
          *    into printf("a:%d b:%d", [event_type, a(), b()])
 	 */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	meta = node_int_new((int64_t)evh->type << 32);
+#else
 	meta = node_int_new(evh->type);
+#endif
 	meta->dyn->type = TYPE_INT;
 	meta->dyn->size = 8;
 	meta->next = varg->next;
 	rec = node_rec_new(meta);
 	varg->next = rec;
+	plan->rec = rec;
 
 	rec->parent = call;
 	node_foreach(varg, rec->rec.vargs) {
@@ -19,21 +19,23 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <ply/ast.h>
 #include <ply/map.h>
 #include <ply/module.h>
 #include <ply/ply.h>
 #include <ply/pvdr.h>
+#include <ply/symtable.h>
 
 int quantize_compile(node_t *call, prog_t *prog)
 {
 	node_t *map = call->parent->method.map;
 
-	emit(prog, LDXDW(BPF_REG_0, map->dyn->addr, BPF_REG_10));
-	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_0, 1));
+	emit(prog, MOV_IMM(BPF_REG_0, 1));
 	emit(prog, STXDW(BPF_REG_10, map->dyn->addr, BPF_REG_0));
-	return 0;
+	return emit_map_xadd(prog, map);
 }
 
 static int quantize_normalize(int log2, char const **suffix)
@@ -83,7 +85,9 @@ static void quantize_dump_bar_ascii(FILE *fp, int64_t count, int64_t max)
 	fputc('|', fp);
 }
 
-static void quantize_dump_one(FILE *fp, int log2, int64_t count, int64_t max)
+typedef void (*hist_label_t)(FILE *fp, node_t *map, int64_t bucket);
+
+static void quantize_label(FILE *fp, node_t *map, int64_t log2)
 {
 	int lo, hi;
 	const char *ls, *hs;
@@ -110,6 +114,12 @@ static void quantize_dump_one(FILE *fp, int log2, int64_t count, int64_t max)
 				ls ? 3 : 4, lo, ls ? : "",
 				hs ? 3 : 4, hi, hs ? : "");
 	}
+}
+
+static void hist_dump_one(FILE *fp, node_t *map, hist_label_t label,
+			  int64_t bucket, int64_t count, int64_t max)
+{
+	label(fp, map, bucket);
 
 	fprintf(fp, "\t%8" PRId64" ", count);
 	if (G.ascii)
@@ -119,35 +129,38 @@ static void quantize_dump_one(FILE *fp, int log2, int64_t count, int64_t max)
 	fputc('\n', fp);
 }
 
-static void quantize_dump_seg(FILE *fp, node_t *map,
-			      void *data, int len, int64_t max)
+/* the last component of the key is the bucket. one segment per
+ * unique value of the other components. */
+static void hist_dump_seg(FILE *fp, node_t *map, hist_label_t label,
+			  void *data, int len, int64_t max)
 {
 	node_t *rec = map->map.rec;
 	size_t entry_size = rec->dyn->size + map->dyn->size;
 	size_t rec_size = rec->dyn->size - sizeof(int64_t);
 	char *key = data;
-	int64_t *log2 = data + rec_size, *count = data + rec->dyn->size;
+	int64_t *bucket = data + rec_size, *count = data + rec->dyn->size;
 
 	dump_rec(fp, rec, data, rec->rec.n_vargs - 1);
 	fputc('\n', fp);
 
 	for (; len > 1; len--) {
-		int last_log2 = *log2 + 1;
+		int64_t last = *bucket + 1;
 
-		quantize_dump_one(fp, *log2, *count, max);
+		hist_dump_one(fp, map, label, *bucket, *count, max);
 
 		key += entry_size;
-		log2 = (void *)log2 + entry_size;
+		bucket = (void *)bucket + entry_size;
 		count = (void *)count + entry_size;
 
-		for (; last_log2 < *log2; last_log2++)
-			quantize_dump_one(fp, last_log2, 0, max);
+		for (; last < *bucket; last++)
+			hist_dump_one(fp, map, label, last, 0, max);
 	}
 
-	quantize_dump_one(fp, *log2, *count, max);
+	hist_dump_one(fp, map, label, *bucket, *count, max);
 }
 
-static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
+static void hist_dump(FILE *fp, node_t *map, hist_label_t label,
+		      void *data, int len)
 {
 	node_t *rec = map->map.rec;
 	size_t entry_size = rec->dyn->size + map->dyn->size;
@@ -165,14 +178,19 @@ static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
 			seg_max = (*count > seg_max) ? *count : seg_max;
 			seg_len++;
 		} else {
-			quantize_dump_seg(fp, map, seg_start, seg_len, seg_max);
+			hist_dump_seg(fp, map, label, seg_start, seg_len, seg_max);
 			seg_max = *count;
 			seg_len = 1;
 			seg_start = key;
 		}
 	}
 
-	quantize_dump_seg(fp, map, seg_start, seg_len, seg_max);
+	hist_dump_seg(fp, map, label, seg_start, seg_len, seg_max);
+}
+
+static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	hist_dump(fp, map, quantize_label, data, len);
 }
 
 int quantize_loc_assign(node_t *call)
@@ -180,6 +198,8 @@ int quantize_loc_assign(node_t *call)
 	node_t *map = call->parent->method.map;
 
 	map->dyn->map.dump = quantize_dump;
+	map->dyn->map.counters = 1;
+	call->dyn->call.inplace = 1;
 	return default_loc_assign(call);
 }
 
@@ -235,3 +255,440 @@ const func_t quantize_func = {
 	.loc_assign = quantize_loc_assign,
 	.annotate = quantize_annotate,
 };
+
+
+/* linear histograms. buckets are [min + n*step, min + (n+1)*step),
+ * with one bucket below min and one at or above max. empty buckets
+ * between the lowest and highest used one are printed, which bounds
+ * the number of buckets. */
+#define LHIST_MAX_BUCKETS 1000
+
+struct lhist {
+	int64_t min, max, step;
+};
+
+static void lhist_label(FILE *fp, node_t *map, int64_t bucket)
+{
+	struct lhist *lh = map->dyn->map.priv;
+	int64_t lo = lh->min + bucket * lh->step;
+	int64_t hi = (lo + lh->step < lh->max) ? lo + lh->step : lh->max;
+	char range[48];
+
+	if (bucket < 0)
+		snprintf(range, sizeof(range), "< %" PRId64, lh->min);
+	else if (lo >= lh->max)
+		snprintf(range, sizeof(range), ">= %" PRId64, lh->max);
+	else
+		snprintf(range, sizeof(range), "[%" PRId64 ", %" PRId64 ")",
+			 lo, hi);
+
+	fprintf(fp, "\t%16s", range);
+}
+
+static void lhist_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	hist_dump(fp, map, lhist_label, data, len);
+}
+
+static int lhist_bucket_compile(node_t *call, prog_t *prog)
+{
+	struct lhist *lh = call->parent->parent->dyn->map.priv;
+	node_t *num = call->call.vargs;
+	int src, dst;
+
+	src = (num->dyn->loc == LOC_REG) ? num->dyn->reg : BPF_REG_0;
+	emit_xfer_dyn(prog, &dyn_reg[src], num);
+
+	dst = (call->dyn->loc == LOC_REG) ? call->dyn->reg : BPF_REG_1;
+
+	emit(prog, MOV_IMM(dst, -1));
+	emit(prog, JMP_IMM(BPF_JSGE, src, lh->min, 1));
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 5));
+
+	emit(prog, MOV_IMM(dst, (lh->max - lh->min + lh->step - 1) / lh->step));
+	emit(prog, JMP_IMM(BPF_JSGE, src, lh->max, 3));
+
+	emit(prog, MOV(dst, src));
+	emit(prog, ALU_IMM(BPF_SUB, dst, lh->min));
+	emit(prog, ALU_IMM(BPF_DIV, dst, lh->step));
+
+	return emit_xfer_dyns(prog, call->dyn, &dyn_reg[dst]);
+}
+
+static int lhist_bucket_annotate(node_t *call)
+{
+	call->dyn->type = TYPE_INT;
+	call->dyn->size = sizeof(int64_t);
+	return 0;
+}
+
+static const func_t lhist_bucket_func = {
+	.name = "lhist-bucket",
+
+	.compile = lhist_bucket_compile,
+	.loc_assign = default_loc_assign,
+	.annotate = lhist_bucket_annotate,
+};
+
+static int lhist_loc_assign(node_t *call)
+{
+	node_t *map = call->parent->method.map;
+
+	map->dyn->map.dump = lhist_dump;
+	map->dyn->map.counters = 1;
+	call->dyn->call.inplace = 1;
+	return default_loc_assign(call);
+}
+
+static int lhist_param(node_t *n, int64_t *val)
+{
+	if (!n || n->type != TYPE_INT ||
+	    n->integer < INT32_MIN || n->integer > INT32_MAX) {
+		_e("lhist: min, max and step must be 32-bit integer literals");
+		return -EINVAL;
+	}
+
+	*val = n->integer;
+	return 0;
+}
+
+static int lhist_annotate(node_t *call)
+{
+	node_t *map = call->parent->method.map;
+	node_t *num = call->call.vargs, *c, *next;
+	struct lhist lh, *prev = map->dyn->map.priv;
+	int err;
+
+	if (call->parent->type != TYPE_METHOD || !num ||
+	    (num->dyn->type != TYPE_NONE && num->dyn->type != TYPE_INT))
+		return -EINVAL;
+
+	err =        lhist_param(num->next, &lh.min);
+	err = err ? : lhist_param(num->next ? num->next->next : NULL, &lh.max);
+	err = err ? : lhist_param((num->next && num->next->next) ?
+				  num->next->next->next : NULL, &lh.step);
+	if (err)
+		return err;
+
+	if (num->next->next->next->next || lh.min >= lh.max || lh.step <= 0) {
+		_e("lhist: expected (value, min, max, step), "
+		   "with min < max and a positive step");
+		return -EINVAL;
+	}
+
+	if ((lh.max - lh.min + lh.step - 1) / lh.step > LHIST_MAX_BUCKETS) {
+		_e("lhist: (max - min) / step is limited to %d buckets",
+		   LHIST_MAX_BUCKETS);
+		return -EINVAL;
+	}
+
+	if (prev && memcmp(prev, &lh, sizeof(lh))) {
+		_e("%s: lhist parameters differ between uses", map->string);
+		return -EINVAL;
+	}
+
+	if (!prev) {
+		prev = malloc(sizeof(*prev));
+		assert(prev);
+		*prev = lh;
+		map->dyn->map.priv = prev;
+	}
+
+	/* like quantize(), rewrite @map[c1].lhist(val, min, max, step)
+	 * into @map[c1, <bucket of val>].lhist(), so that an update
+	 * only touches one 8 byte counter. */
+	for (c = num->next; c; c = next) {
+		next = c->next;
+		node_free(c);
+	}
+	num->next = NULL;
+
+	for (c = map->map.rec->rec.vargs; c->next; c = c->next);
+
+	c->next = node_call_new(strdup("lhist"), strdup("bucket"), num);
+	c->next->parent = map->map.rec;
+	c = c->next;
+
+	c->dyn->call.func = &lhist_bucket_func;
+	err = c->dyn->call.func->annotate(c);
+	if (err)
+		return err;
+
+	map->map.rec->rec.n_vargs++;
+	call->call.vargs = NULL;
+	call->call.n_vargs = 0;
+
+	call->dyn->type = TYPE_INT;
+	call->dyn->size = sizeof(int64_t);
+	return 0;
+}
+
+const func_t lhist_func = {
+	.name = "lhist",
+
+	.compile = quantize_compile,
+	.loc_assign = lhist_loc_assign,
+	.annotate = lhist_annotate,
+};
+
+
+/* quantile sketches. values are counted in log-linear buckets: each
+ * power of two is split into 1 << QUANTILES_SUB buckets, so that
+ * any value is within 1/(2 << QUANTILES_SUB) of the middle of its
+ * bucket. values below 1 << QUANTILES_SUB get a bucket each,
+ * negative ones share bucket -1. */
+#define QUANTILES_SUB 4
+#define QUANTILES_MAX 8
+
+/* -1 for negative values, then up to log2(INT64_MAX) + 1 = 63 */
+#define QUANTILES_BUCKETS (((63 - QUANTILES_SUB) << QUANTILES_SUB) + \
+			   (1 << QUANTILES_SUB) + 1)
+
+struct quantiles {
+	int n;
+	double p[QUANTILES_MAX];
+	char  *label[QUANTILES_MAX];
+};
+
+static int quantiles_bucket_compile(node_t *call, prog_t *prog)
+{
+	node_t *num = call->call.vargs;
+
+	emit_xfer_dyn(prog, &dyn_reg[BPF_REG_0], num);
+	emit(prog, MOV(BPF_REG_1, BPF_REG_0));
+	emit_log2_raw(prog, BPF_REG_2, BPF_REG_1);
+
+	/* small values are their own bucket */
+	emit(prog, JMP_IMM(BPF_JSGT, BPF_REG_2, QUANTILES_SUB, 4));
+	emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+	emit(prog, JMP_IMM(BPF_JSGE, BPF_REG_0, 0, 1));
+	emit(prog, MOV_IMM(BPF_REG_3, -1));
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 8));
+
+	/* r2 is log2(value) + 1, the bucket is the exponent followed
+	 * by the QUANTILES_SUB bits below the leading one. */
+	emit(prog, MOV(BPF_REG_4, BPF_REG_2));
+	emit(prog, ALU_IMM(BPF_SUB, BPF_REG_4, QUANTILES_SUB + 1));
+	emit(prog, MOV(BPF_REG_3, BPF_REG_0));
+	emit(prog, ALU(BPF_RSH, BPF_REG_3, BPF_REG_4));
+	emit(prog, ALU_IMM(BPF_AND, BPF_REG_3, (1 << QUANTILES_SUB) - 1));
+	emit(prog, ALU_IMM(BPF_SUB, BPF_REG_2, QUANTILES_SUB));
+	emit(prog, ALU_IMM(BPF_LSH, BPF_REG_2, QUANTILES_SUB));
+	emit(prog, ALU(BPF_ADD, BPF_REG_3, BPF_REG_2));
+
+	return emit_xfer_dyns(prog, call->dyn, &dyn_reg[BPF_REG_3]);
+}
+
+static int quantiles_bucket_annotate(node_t *call)
+{
+	call->dyn->type = TYPE_INT;
+	call->dyn->size = sizeof(int64_t);
+	return 0;
+}
+
+static const func_t quantiles_bucket_func = {
+	.name = "quantiles-bucket",
+
+	.compile = quantiles_bucket_compile,
+	.loc_assign = default_loc_assign,
+	.annotate = quantiles_bucket_annotate,
+};
+
+/* the middle of the range of integers in the bucket */
+static double quantiles_value(int64_t bucket)
+{
+	int64_t sub = bucket & ((1 << QUANTILES_SUB) - 1);
+	int exp = (bucket >> QUANTILES_SUB) - 1;
+	double lo, width;
+
+	if (bucket < (1 << QUANTILES_SUB))
+		return bucket;
+
+	width = (double)(1ULL << exp);
+	lo = (double)((1 << QUANTILES_SUB) + sub) * width;
+	return lo + (width - 1.0) / 2.0;
+}
+
+static void quantiles_dump_seg(FILE *fp, node_t *map, void *data, int len)
+{
+	struct quantiles *q = map->dyn->map.priv;
+	node_t *rec = map->map.rec;
+	size_t entry_size = rec->dyn->size + map->dyn->size;
+	size_t rec_size = rec->dyn->size - sizeof(int64_t);
+	int64_t bucket, count, total = 0, sum;
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		memcpy(&count, data + i * entry_size + rec->dyn->size,
+		       sizeof(count));
+		total += count;
+	}
+
+	dump_rec(fp, rec, data, rec->rec.n_vargs - 1);
+	fprintf(fp, "\n\t%-8s\t%8" PRId64 "\n", "count", total);
+
+	for (j = 0; j < q->n; j++) {
+		for (i = 0, sum = 0; i < len; i++) {
+			memcpy(&count, data + i * entry_size + rec->dyn->size,
+			       sizeof(count));
+			sum += count;
+			if (sum >= q->p[j] * total / 100.0)
+				break;
+		}
+
+		memcpy(&bucket, data + (i < len ? i : len - 1) * entry_size
+		       + rec_size, sizeof(bucket));
+
+		if (bucket < 0)
+			fprintf(fp, "\t%-8s\t%8s\n", q->label[j], "< 0");
+		else
+			fprintf(fp, "\t%-8s\t%8.0f\n", q->label[j],
+				quantiles_value(bucket));
+	}
+}
+
+static void quantiles_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	node_t *rec = map->map.rec;
+	size_t entry_size = rec->dyn->size + map->dyn->size;
+	size_t rec_size = rec->dyn->size - sizeof(int64_t);
+	char *key = data, *seg_start = data;
+	int seg_len = 1;
+
+	if (!len)
+		return;
+
+	for (; len > 1; len--) {
+		key += entry_size;
+
+		if (!memcmp(key, seg_start, rec_size)) {
+			seg_len++;
+		} else {
+			quantiles_dump_seg(fp, map, seg_start, seg_len);
+			seg_len = 1;
+			seg_start = key;
+		}
+	}
+
+	quantiles_dump_seg(fp, map, seg_start, seg_len);
+}
+
+static int quantiles_loc_assign(node_t *call)
+{
+	node_t *map = call->parent->method.map;
+	sym_t *s = sym_from_node(map);
+
+	map->dyn->map.dump = quantiles_dump;
+	map->dyn->map.counters = 1;
+	call->dyn->call.inplace = 1;
+
+	/* every bucket of every key is an entry of its own. make room
+	 * for all of them, only allocating the ones that are used.
+	 * lru maps must be preallocated, they evict unused buckets
+	 * instead. */
+#ifdef BPF_F_NO_PREALLOC
+	if (!G.lru) {
+		s->map->flags |= BPF_F_NO_PREALLOC;
+		s->map->nelem = G.map_nelem * QUANTILES_BUCKETS;
+		return default_loc_assign(call);
+	}
+#endif
+	if (s->map->nelem < (G.map_nelem << 4))
+		s->map->nelem = G.map_nelem << 4;
+
+	return default_loc_assign(call);
+}
+
+/* "50,99,99.9" -> p50, p99, p99.9 */
+static int quantiles_parse(struct quantiles *q, const char *spec)
+{
+	char *str = strdup(spec), *tok, *end;
+	int err = 0;
+
+	for (tok = strtok(str, ", "); tok; tok = strtok(NULL, ", ")) {
+		if (q->n == QUANTILES_MAX) {
+			_e("quantiles: at most %d percentiles", QUANTILES_MAX);
+			err = -EINVAL;
+			break;
+		}
+
+		q->p[q->n] = strtod(tok, &end);
+		if (*end || q->p[q->n] <= 0.0 || q->p[q->n] > 100.0) {
+			_e("quantiles: invalid percentile \"%s\"", tok);
+			err = -EINVAL;
+			break;
+		}
+
+		q->label[q->n] = malloc(strlen(tok) + 2);
+		assert(q->label[q->n]);
+		sprintf(q->label[q->n], "p%s", tok);
+		q->n++;
+	}
+
+	free(str);
+	return err;
+}
+
+static int quantiles_annotate(node_t *call)
+{
+	node_t *map = call->parent->method.map;
+	node_t *num = call->call.vargs, *spec, *c;
+	struct quantiles *q;
+	int err;
+
+	if (call->parent->type != TYPE_METHOD || !num ||
+	    (num->dyn->type != TYPE_NONE && num->dyn->type != TYPE_INT))
+		return -EINVAL;
+
+	spec = num->next;
+	if (spec && (spec->type != TYPE_STR || spec->next)) {
+		_e("quantiles: percentiles must be a string literal, "
+		   "e.g. \"50,99,99.9\"");
+		return -EINVAL;
+	}
+
+	if (!map->dyn->map.priv) {
+		q = calloc(1, sizeof(*q));
+		assert(q);
+
+		err = quantiles_parse(q, spec ? spec->string : "50,90,99,99.9");
+		if (err)
+			return err;
+
+		map->dyn->map.priv = q;
+	}
+
+	if (spec) {
+		node_free(spec);
+		num->next = NULL;
+	}
+
+	/* like quantize(), the bucket becomes the last component of
+	 * the key. */
+	for (c = map->map.rec->rec.vargs; c->next; c = c->next);
+
+	c->next = node_call_new(strdup("quantiles"), strdup("bucket"), num);
+	c->next->parent = map->map.rec;
+	c = c->next;
+
+	c->dyn->call.func = &quantiles_bucket_func;
+	err = c->dyn->call.func->annotate(c);
+	if (err)
+		return err;
+
+	map->map.rec->rec.n_vargs++;
+	call->call.vargs = NULL;
+	call->call.n_vargs = 0;
+
+	call->dyn->type = TYPE_INT;
+	call->dyn->size = sizeof(int64_t);
+	return 0;
+}
+
+const func_t quantiles_func = {
+	.name = "quantiles",
+
+	.compile = quantize_compile,
+	.loc_assign = quantiles_loc_assign,
+	.annotate = quantiles_annotate,
+};
@@ -0,0 +1,524 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ply/ply.h>
+#include <ply/bpf-syscall.h>
+#include <ply/map.h>
+#include <ply/output.h>
+#include <ply/symtable.h>
+
+static const char *output_fmt_names[] = {
+	[OUTPUT_TEXT]   = "text",
+	[OUTPUT_JSON]   = "json",
+	[OUTPUT_CSV]    = "csv",
+	[OUTPUT_BINARY] = "binary",
+};
+
+int output_fmt_parse(const char *name)
+{
+	int fmt;
+
+	for (fmt = OUTPUT_TEXT; fmt <= OUTPUT_BINARY; fmt++)
+		if (!strcmp(name, output_fmt_names[fmt]))
+			return fmt;
+
+	return -EINVAL;
+}
+
+void obuf_flush(obuf_t *ob)
+{
+	if (ob->len)
+		fwrite(ob->data, 1, ob->len, ob->fp);
+
+	ob->len = 0;
+}
+
+void obuf_put(obuf_t *ob, const char *str, size_t len)
+{
+	if (ob->len + len > sizeof(ob->data)) {
+		obuf_flush(ob);
+
+		if (len > sizeof(ob->data)) {
+			fwrite(str, 1, len, ob->fp);
+			return;
+		}
+	}
+
+	memcpy(ob->data + ob->len, str, len);
+	ob->len += len;
+}
+
+static inline void obuf_puts(obuf_t *ob, const char *str)
+{
+	obuf_put(ob, str, strlen(str));
+}
+
+void obuf_pad(obuf_t *ob, char c, int n)
+{
+	char pad[0x20];
+	int len;
+
+	if (n <= 0)
+		return;
+
+	memset(pad, c, sizeof(pad));
+	for (; n > 0; n -= len) {
+		len = (n < (int)sizeof(pad)) ? n : (int)sizeof(pad);
+		obuf_put(ob, pad, len);
+	}
+}
+
+static const char obuf_dec2[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+/* format v right-aligned, ending at end. returns the first digit. */
+char *obuf_utoa(char *end, uint64_t v, char conv)
+{
+	const char *digits = (conv == 'X') ?
+		"0123456789ABCDEF" : "0123456789abcdef";
+
+	switch (conv) {
+	case 'o':
+		do {
+			*--end = '0' + (v & 7);
+			v >>= 3;
+		} while (v);
+		break;
+	case 'x':
+	case 'X':
+		do {
+			*--end = digits[v & 0xf];
+			v >>= 4;
+		} while (v);
+		break;
+	default:
+		for (; v >= 100; v /= 100) {
+			end -= 2;
+			memcpy(end, &obuf_dec2[(v % 100) << 1], 2);
+		}
+
+		if (v >= 10) {
+			end -= 2;
+			memcpy(end, &obuf_dec2[v << 1], 2);
+		} else {
+			*--end = '0' + v;
+		}
+		break;
+	}
+
+	return end;
+}
+
+static void output_int(obuf_t *ob, void *data)
+{
+	char buf[24], *end = buf + sizeof(buf), *str;
+	int64_t num;
+
+	/* copy, don't cast. we could be on a platform that does not
+	 * handle unaligned accesses */
+	memcpy(&num, data, sizeof(num));
+
+	str = obuf_utoa(end, (num < 0) ? -(uint64_t)num : num, 'd');
+	if (num < 0)
+		*--str = '-';
+
+	obuf_put(ob, str, end - str);
+}
+
+static void output_str(obuf_t *ob, output_fmt_t fmt, const char *str,
+		       size_t size)
+{
+	const char *end = str + strnlen(str, size), *span, *esc;
+	char hex[8];
+
+	if (fmt == OUTPUT_CSV) {
+		for (span = str; span < end; span++)
+			if (strchr(",\"\r\n", *span))
+				break;
+
+		if (span == end) {
+			obuf_put(ob, str, end - str);
+			return;
+		}
+	}
+
+	obuf_put(ob, "\"", 1);
+	for (span = str; str < end; str++) {
+		if (fmt == OUTPUT_CSV) {
+			if (*str != '"')
+				continue;
+
+			esc = "\"\"";
+		} else {
+			if ((unsigned char)*str >= 0x20 &&
+			    *str != '"' && *str != '\\')
+				continue;
+
+			switch (*str) {
+			case '"':  esc = "\\\""; break;
+			case '\\': esc = "\\\\"; break;
+			case '\n': esc = "\\n";  break;
+			case '\t': esc = "\\t";  break;
+			default:
+				snprintf(hex, sizeof(hex), "\\u%04x",
+					 (unsigned char)*str);
+				esc = hex;
+				break;
+			}
+		}
+
+		obuf_put(ob, span, str - span);
+		obuf_puts(ob, esc);
+		span = str + 1;
+	}
+
+	obuf_put(ob, span, str - span);
+	obuf_put(ob, "\"", 1);
+}
+
+static void output_sym(obuf_t *ob, output_fmt_t fmt, void *data)
+{
+	uintptr_t pc = *((uint64_t *)data);
+	const ksym_t *k;
+	char buf[24];
+
+	k = G.ksyms ? ksym_get(G.ksyms, pc) : NULL;
+	if (k) {
+		output_str(ob, fmt, k->sym, sizeof(k->sym));
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "%#" PRIxPTR, pc);
+	output_str(ob, fmt, buf, sizeof(buf));
+}
+
+/* json gets an array of frames, csv a single folded string
+ * (outermost;...;innermost) which is what flame graph tools expect. */
+static void output_stack(obuf_t *ob, output_fmt_t fmt, node_t *stack,
+			 void *data)
+{
+	uint32_t stack_id = *((int64_t *)data);
+	char frames[0x10][0x60], folded[sizeof(frames)];
+	uint64_t ips[0x10];
+	const ksym_t *k;
+	size_t len = 0;
+	sym_t *s;
+	int i, n;
+
+	s = symtable_get_stack(node_get_script(stack)->dyn->script.st);
+	if (!s || bpf_map_lookup(s->map->fd, &stack_id, ips)) {
+		obuf_puts(ob, (fmt == OUTPUT_JSON) ? "null" : "");
+		return;
+	}
+
+	for (n = 0; n < 0x10 && ips[n]; n++) {
+		k = G.ksyms ? ksym_get(G.ksyms, ips[n]) : NULL;
+		if (!k)
+			snprintf(frames[n], sizeof(frames[n]), "%#" PRIxPTR,
+				 (uintptr_t)ips[n]);
+		else if (ips[n] == k->start)
+			snprintf(frames[n], sizeof(frames[n]), "%s", k->sym);
+		else
+			snprintf(frames[n], sizeof(frames[n]), "%s+%#" PRIxPTR,
+				 k->sym, (uintptr_t)(ips[n] - k->start));
+	}
+
+	if (fmt == OUTPUT_JSON) {
+		obuf_put(ob, "[", 1);
+		for (i = 0; i < n; i++) {
+			if (i)
+				obuf_put(ob, ",", 1);
+			output_str(ob, fmt, frames[i], sizeof(frames[i]));
+		}
+		obuf_put(ob, "]", 1);
+		return;
+	}
+
+	for (i = n - 1; i >= 0; i--)
+		len += snprintf(folded + len, sizeof(folded) - len, "%s%s",
+				frames[i], i ? ";" : "");
+
+	output_str(ob, fmt, folded, sizeof(folded));
+}
+
+/* json gets an object, csv a single "name=value ..." string. */
+static void output_words(obuf_t *ob, output_fmt_t fmt,
+			 const char *const *words, void *data)
+{
+	char buf[0x100] = "";
+	size_t len = 0;
+	int64_t num;
+	int i;
+
+	if (fmt == OUTPUT_JSON)
+		obuf_put(ob, "{", 1);
+
+	for (i = 0; words[i]; i++, data += sizeof(num)) {
+		memcpy(&num, data, sizeof(num));
+
+		if (fmt != OUTPUT_JSON) {
+			len += snprintf(buf + len, sizeof(buf) - len,
+					"%s%s=%" PRId64, i ? " " : "",
+					words[i], num);
+			continue;
+		}
+
+		if (i)
+			obuf_put(ob, ",", 1);
+		output_str(ob, fmt, words[i], strlen(words[i]));
+		obuf_put(ob, ":", 1);
+		output_int(ob, data);
+	}
+
+	if (fmt == OUTPUT_JSON)
+		obuf_put(ob, "}", 1);
+	else
+		output_str(ob, fmt, buf, sizeof(buf));
+}
+
+static void output_field(obuf_t *ob, output_fmt_t fmt, node_t *n, void *data)
+{
+	if (n->dump == dump_sym) {
+		output_sym(ob, fmt, data);
+		return;
+	}
+
+	if (n->type == TYPE_MAP && n->dyn->map.words) {
+		output_words(ob, fmt, n->dyn->map.words, data);
+		return;
+	}
+
+	switch (n->dyn->type) {
+	case TYPE_INT:
+		output_int(ob, data);
+		break;
+	case TYPE_STR:
+		output_str(ob, fmt, data, n->dyn->size);
+		break;
+	case TYPE_STACK:
+		output_stack(ob, fmt, n, data);
+		break;
+	default:
+		obuf_puts(ob, (fmt == OUTPUT_JSON) ? "null" : "");
+		break;
+	}
+}
+
+/* output fields [from, to), as a json array if there is more than one
+ * of them. */
+static void output_fields(obuf_t *ob, output_fmt_t fmt, oenc_t *enc,
+			   int from, int to, void *data)
+{
+	int i, array = (fmt == OUTPUT_JSON) && (to - from != 1);
+
+	if (array)
+		obuf_put(ob, "[", 1);
+
+	for (i = from; i < to; i++) {
+		if (i != from)
+			obuf_put(ob, ",", 1);
+
+		output_field(ob, fmt, enc->fields[i], data);
+		data += enc->fields[i]->dyn->size;
+	}
+
+	if (array)
+		obuf_put(ob, "]", 1);
+}
+
+static void output_frame(obuf_t *ob, uint32_t kind, void *data, size_t size)
+{
+	struct oframe frame = {
+		.len  = sizeof(frame) + ((size + 7) & ~7),
+		.kind = kind,
+	};
+	char pad[8] = { 0 };
+
+	obuf_put(ob, (char *)&frame, sizeof(frame));
+	obuf_put(ob, data, size);
+	obuf_put(ob, pad, frame.len - sizeof(frame) - size);
+}
+
+int output_event(FILE *fp, oenc_t *enc, event_t *ev, size_t size)
+{
+	char buf[24], *end = buf + sizeof(buf), *str;
+	obuf_t ob = { .fp = fp };
+
+	switch (G.format) {
+	case OUTPUT_BINARY:
+		output_frame(&ob, OFRAME_EVENT, ev, size);
+		break;
+	case OUTPUT_JSON:
+		obuf_puts(&ob, "{\"event\":");
+		str = obuf_utoa(end, ev->type, 'd');
+		obuf_put(&ob, str, end - str);
+		obuf_puts(&ob, ",\"args\":");
+
+		/* always an array, even with a single argument */
+		if (enc->nfields == 1)
+			obuf_put(&ob, "[", 1);
+		output_fields(&ob, G.format, enc, 0, enc->nfields, ev->data);
+		if (enc->nfields == 1)
+			obuf_put(&ob, "]", 1);
+
+		obuf_puts(&ob, "}\n");
+		break;
+	case OUTPUT_CSV:
+		str = obuf_utoa(end, ev->type, 'd');
+		obuf_put(&ob, str, end - str);
+		if (enc->nfields)
+			obuf_put(&ob, ",", 1);
+		output_fields(&ob, G.format, enc, 0, enc->nfields, ev->data);
+		obuf_put(&ob, "\n", 1);
+		break;
+	default:
+		break;
+	}
+
+	obuf_flush(&ob);
+	return 0;
+}
+
+static void output_map_header(obuf_t *ob, oenc_t *enc)
+{
+	int i;
+
+	switch (G.format) {
+	case OUTPUT_BINARY:
+		output_frame(ob, OFRAME_MAP, (void *)enc->name,
+			     strlen(enc->name) + 1);
+		break;
+	case OUTPUT_CSV:
+		obuf_puts(ob, "map");
+		for (i = 0; i < enc->nkeys; i++) {
+			obuf_put(ob, ",", 1);
+			obuf_puts(ob, node_str(enc->fields[i]));
+		}
+		obuf_puts(ob, ",value\n");
+		break;
+	default:
+		break;
+	}
+}
+
+void output_map(FILE *fp, node_t *map, void *data, int len, size_t rsize)
+{
+	obuf_t ob = { .fp = fp };
+	size_t ksize = map->map.rec->dyn->size;
+	oenc_t *enc;
+
+	/* built once per dump, each entry is then output by walking
+	 * a flat list of fields. */
+	enc = oenc_new(map->string, map->map.rec->rec.vargs, map);
+
+	output_map_header(&ob, enc);
+
+	for (; len > 0; len--, data += rsize) {
+		switch (G.format) {
+		case OUTPUT_BINARY:
+			output_frame(&ob, OFRAME_ENTRY, data, rsize);
+			break;
+		case OUTPUT_JSON:
+			obuf_puts(&ob, "{\"map\":");
+			output_str(&ob, G.format, enc->name, strlen(enc->name));
+			obuf_puts(&ob, ",\"key\":");
+			output_fields(&ob, G.format, enc, 0, enc->nkeys, data);
+			obuf_puts(&ob, ",\"value\":");
+			output_fields(&ob, G.format, enc,
+				      enc->nkeys, enc->nfields, data + ksize);
+			obuf_puts(&ob, "}\n");
+			break;
+		case OUTPUT_CSV:
+			obuf_puts(&ob, enc->name);
+			obuf_put(&ob, ",", 1);
+			output_fields(&ob, G.format, enc, 0, enc->nkeys, data);
+			obuf_put(&ob, ",", 1);
+			output_fields(&ob, G.format, enc,
+				      enc->nkeys, enc->nfields, data + ksize);
+			obuf_put(&ob, "\n", 1);
+			break;
+		default:
+			break;
+		}
+	}
+
+	obuf_flush(&ob);
+	free(enc);
+}
+
+static int oenc_count(node_t *n)
+{
+	node_t *varg;
+	int count = 0;
+
+	if (n->type != TYPE_REC)
+		return 1;
+
+	node_foreach(varg, n->rec.vargs)
+		count += oenc_count(varg);
+
+	return count;
+}
+
+static void oenc_add(oenc_t *enc, node_t *n)
+{
+	node_t *varg;
+
+	if (n->type != TYPE_REC) {
+		enc->fields[enc->nfields++] = n;
+		return;
+	}
+
+	node_foreach(varg, n->rec.vargs)
+		oenc_add(enc, varg);
+}
+
+oenc_t *oenc_new(const char *name, node_t *keys, node_t *val)
+{
+	oenc_t *enc;
+	node_t *n;
+	int count = val ? oenc_count(val) : 0;
+
+	node_foreach(n, keys)
+		count += oenc_count(n);
+
+	enc = calloc(1, sizeof(*enc) + count * sizeof(enc->fields[0]));
+	assert(enc);
+
+	enc->name = name;
+
+	node_foreach(n, keys)
+		oenc_add(enc, n);
+
+	enc->nkeys = enc->nfields;
+
+	if (val)
+		oenc_add(enc, val);
+
+	return enc;
+}
@@ -17,9 +17,10 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
 #include <linux/version.h>
-#include <signal.h>
 #include <stdio.h>
 #include <sys/resource.h>
 #include <sys/types.h>
@@ -28,6 +29,7 @@
 #include <ply/ast.h>
 #include <ply/evpipe.h>
 #include <ply/map.h>
+#include <ply/output.h>
 #include <ply/ply.h>
 #include <ply/pvdr.h>
 
@@ -37,15 +39,32 @@ FILE *scriptfp;
 
 struct globals G;
 
-static const char *sopts = "AcdDht:v";
+static const char *sopts = "a:Ab:B:cC:dDe::fF:hi:I:j:l:n:O:r:R:s::t:vw:";
 static struct option lopts[] = {
-	{ "ascii",   no_argument,       0, 'A' },
-	{ "command", no_argument,       0, 'c' },
-	{ "debug",   no_argument,       0, 'd' },
-	{ "dump",    no_argument,       0, 'D' },
-	{ "help",    no_argument,       0, 'h' },
-	{ "timeout", required_argument, 0, 't' },
-	{ "version", no_argument,       0, 'v' },
+	{ "async",      required_argument, 0, 'a' },
+	{ "ascii",      no_argument,       0, 'A' },
+	{ "bufsize",    required_argument, 0, 'b' },
+	{ "backend",    required_argument, 0, 'B' },
+	{ "command",    no_argument,       0, 'c' },
+	{ "cpus",       required_argument, 0, 'C' },
+	{ "debug",      no_argument,       0, 'd' },
+	{ "dump",       no_argument,       0, 'D' },
+	{ "evict",      optional_argument, 0, 'e' },
+	{ "flight",     no_argument,       0, 'f' },
+	{ "format",     required_argument, 0, 'F' },
+	{ "help",       no_argument,       0, 'h' },
+	{ "interval",   required_argument, 0, 'i' },
+	{ "cumulative", required_argument, 0, 'I' },
+	{ "workers",    required_argument, 0, 'j' },
+	{ "latency",    required_argument, 0, 'l' },
+	{ "top",        required_argument, 0, 'n' },
+	{ "ordered",    required_argument, 0, 'O' },
+	{ "record",     required_argument, 0, 'r' },
+	{ "replay",     required_argument, 0, 'R' },
+	{ "stats",      optional_argument, 0, 's' },
+	{ "timeout",    required_argument, 0, 't' },
+	{ "version",    no_argument,       0, 'v' },
+	{ "wakeup",     required_argument, 0, 'w' },
 
 	{ NULL }
 };
@@ -59,16 +78,43 @@ static void usage()
 	     "  ply [options] -c <script_string>\n"
 	     "\n"
 	     "Options:\n"
+	     "  -a <size>           Buffer up to <size> bytes of events while output is slow.\n"
 	     "  -A                  ASCII output only, no Unicode.\n"
+	     "  -b <size>|auto      Use <size> bytes of event queue per cpu, or grow on demand.\n"
+	     "  -B perf|ringbuf     Transport events over per-cpu perf queues, or one ringbuf.\n"
 	     "  -c <script_string>  Execute script literate.\n"
+	     "  -C <cpu-list>       Only collect events from the cpus in <cpu-list>.\n"
 	     "  -d                  Enable debug output.\n"
 	     "  -D                  Dump generated BPF and exit.\n"
+	     "  -e[<ttl>]           Evict least recently used map entries, or after <ttl>.\n"
+	     "  -f                  Flight recorder, only output events on SIGUSR1 and exit.\n"
+	     "  -F <format>         Output format, one of text, json, csv or binary.\n"
 	     "  -h                  Print usage message and exit.\n"
+	     "  -i <period>         Print the change of every map each <period>.\n"
+	     "  -I <period>         Print the contents of every map each <period>.\n"
+	     "  -j <workers>        Drain event queues using <workers> threads.\n"
+	     "  -l <latency>        Flush batched events at least every <latency>.\n"
+	     "  -n [@<map>=]<n>     Only print the <n> last entries of every map, or of <map>.\n"
+	     "  -O <window>         Output events in time order, delaying them up to <window>.\n"
+	     "  -r <file>           Record raw events to <file> instead of printing them.\n"
+	     "  -R <file>           Replay events recorded to <file> by the same script.\n"
+	     "  -s[<period>]        Print queue statistics on exit, SIGUSR1 or every <period>.\n"
 	     "  -t <timeout>        Terminate trace after <timeout> seconds.\n"
 	     "  -v                  Print version information.\n"
+	     "  -w <n>[b|k|M]       Wake up after <n> events, or <n> bytes if suffixed.\n"
 		);
 }
 
+static int map_tick(void *script)
+{
+	return map_interval(script);
+}
+
+static int map_tick_sweep(void *script)
+{
+	return map_sweep(script);
+}
+
 static void version()
 {
 	fputs(PACKAGE "-" VERSION, stdout);
@@ -84,38 +130,191 @@ static void version()
 
 static int parse_opts(int argc, char **argv, FILE **sfp)
 {
+	long timeout;
+	ssize_t size;
 	int cmd = 0;
 	int opt;
 
 	G.map_nelem = 0x400;
+	G.wakeup_events = 1;
+	G.latency = 100;
+	G.bufsize = 4 << 10;
 
 	while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) > 0) {
 		switch (opt) {
+		case 'a':
+			if (str_to_size(optarg) <= 0) {
+				_e("async queue size must be a positive size");
+				usage(); exit(1);
+			}
+			G.async = str_to_size(optarg);
+			break;
 		case 'A':
 			G.ascii = 1;
 			break;
+		case 'b':
+			if (!strcmp(optarg, "auto")) {
+				G.bufauto = 1;
+				break;
+			}
+
+			size = str_to_size(optarg);
+			if (size <= 0) {
+				_e("bufsize must be a positive size or \"auto\"");
+				usage(); exit(1);
+			}
+			if ((size_t)size > EVPIPE_QSIZE_MAX) {
+				_e("bufsize may not be larger than %luM",
+				   EVPIPE_QSIZE_MAX >> 20);
+				exit(1);
+			}
+			G.bufsize = size;
+			break;
+		case 'B':
+			if (!strcmp(optarg, "ringbuf")) {
+				G.ringbuf = 1;
+			} else if (strcmp(optarg, "perf")) {
+				_e("backend must be \"perf\" or \"ringbuf\"");
+				usage(); exit(1);
+			}
+			break;
 		case 'c':
 			cmd = 1;
 			break;
+		case 'C':
+			G.cpus = optarg;
+			break;
 		case 'd':
 			G.debug = 1;
 			break;
 		case 'D':
 			G.dump = 1;
 			break;
+		case 'e':
+			G.lru = 1;
+			if (!optarg)
+				break;
+
+			G.ttl = str_to_msecs(optarg, 1000);
+			if (G.ttl <= 0) {
+				_e("ttl must be a positive duration");
+				usage(); exit(1);
+			}
+			break;
+		case 'f':
+			G.flight = 1;
+			break;
+		case 'F':
+			G.format = output_fmt_parse(optarg);
+			if (G.format < 0) {
+				_e("format must be one of text, json, csv or binary");
+				usage(); exit(1);
+			}
+			break;
 		case 'h':
 			usage(); exit(0);
 			break;
+		case 'i':
+		case 'I':
+			G.interval = str_to_msecs(optarg, 1000);
+			if (G.interval <= 0) {
+				_e("interval must be a positive duration");
+				usage(); exit(1);
+			}
+
+			G.cumulative = (opt == 'I');
+			break;
+		case 'j':
+			G.workers = strtol(optarg, NULL, 0);
+			if (G.workers <= 0) {
+				_e("workers must be a positive integer");
+				usage(); exit(1);
+			}
+			break;
+		case 'l':
+			G.latency = str_to_msecs(optarg, 1);
+			if (G.latency <= 0) {
+				_e("latency must be a positive duration");
+				usage(); exit(1);
+			}
+			break;
+		case 'n':
+			if (optarg[0] == '@') {
+				if (!strchr(optarg, '=') ||
+				    strtol(strchr(optarg, '=') + 1, NULL, 0) <= 0) {
+					_e("map limit must be @<map>=<n>, <n> positive");
+					usage(); exit(1);
+				}
+
+				G.tops = realloc(G.tops, ++G.ntops * sizeof(*G.tops));
+				assert(G.tops);
+				G.tops[G.ntops - 1] = optarg;
+				break;
+			}
+
+			if (strtol(optarg, NULL, 0) <= 0) {
+				_e("limit must be a positive integer");
+				usage(); exit(1);
+			}
+			G.top = strtol(optarg, NULL, 0);
+			break;
+		case 'O':
+			G.order = str_to_msecs(optarg, 1);
+			if (G.order <= 0) {
+				_e("ordering window must be a positive duration");
+				usage(); exit(1);
+			}
+			break;
+		case 'r':
+			G.record = optarg;
+			break;
+		case 'R':
+			G.replay = optarg;
+			break;
+		case 's':
+			G.stats = 1;
+			if (!optarg)
+				break;
+
+			G.stats_period = str_to_msecs(optarg, 1000);
+			if (G.stats_period <= 0) {
+				_e("stats period must be a positive duration");
+				usage(); exit(1);
+			}
+			break;
 		case 't':
-			G.timeout = strtol(optarg, NULL, 0);
-			if (G.timeout <= 0) {
+			/* the timer is armed in milliseconds */
+			timeout = strtol(optarg, NULL, 0);
+			if (timeout <= 0 || timeout > INT_MAX ||
+			    timeout > LONG_MAX / 1000) {
 				_e("timeout must be a positive integer");
 				usage(); exit(1);
 			}
+			G.timeout = timeout;
 			break;
 		case 'v':
 			version(); exit(0);
 			break;
+		case 'w':
+			G.wakeup_events = G.wakeup_bytes = 0;
+
+			/* empty arguments, parse errors and counts beyond
+			 * int are left at 0 and rejected below. */
+			if (optarg[0] && isdigit(optarg[strlen(optarg) - 1])) {
+				size = strtol(optarg, NULL, 0);
+				if (size > 0 && size <= INT_MAX)
+					G.wakeup_events = size;
+			} else if (optarg[0]) {
+				size = str_to_size(optarg);
+				if (size > 0 && size <= INT_MAX)
+					G.wakeup_bytes = size;
+			}
+
+			if (G.wakeup_events <= 0 && G.wakeup_bytes <= 0) {
+				_e("wakeup must be a positive event or byte count");
+				usage(); exit(1);
+			}
+			break;
 
 		default:
 			_e("unknown option '%c'", opt);
@@ -182,13 +381,6 @@ static void memlock_uncap(void)
 	_d("unlimited memlock");
 }
 
-static int term_sig = 0;
-static void term(int sig)
-{
-	term_sig = sig;
-	return;
-}
-
 int main(int argc, char **argv)
 {
 	evpipe_t *evp;
@@ -221,11 +413,18 @@ int main(int argc, char **argv)
 	if (err)
 		goto err;
 
+	/* events carry everything needed to format them, no need to
+	 * touch the kernel. */
+	if (G.replay) {
+		err = evpipe_replay(G.replay, 0);
+		goto done;
+	}
+
 	evp = calloc(1, sizeof(*evp));
 	assert(evp);
 	script->dyn->script.evp = evp;
 
-	err = evpipe_init(evp, 4 << 10);
+	err = evpipe_init(evp, G.bufsize);
 	if (err)
 		goto err;
 
@@ -262,17 +461,13 @@ int main(int argc, char **argv)
 		goto err;
 	}
 
-	if (G.timeout) {
-		siginterrupt(SIGALRM, 1);
-		signal(SIGALRM, term);
-		alarm(G.timeout);
-	}
+	evp->tick      = map_tick;
+	evp->tick_priv = script;
+	evp->sweep      = map_tick_sweep;
+	evp->sweep_priv = script;
 
-	siginterrupt(SIGINT, 1);
-	signal(SIGINT, term);
-	
 	fprintf(stderr, "%d probe%s active\n", total, (total == 1) ? "" : "s");
-	err = evpipe_loop(evp, &term_sig, 0);
+	err = evpipe_loop(evp, 0);
 
 	fprintf(stderr, "de-activating probes\n");
 
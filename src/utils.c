@@ -17,6 +17,13 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <ply/ply.h>
 
 char *str_escape(char *str)
@@ -51,3 +58,99 @@ char *str_escape(char *str)
 
 	return str;
 }
+
+ssize_t str_to_size(const char *str)
+{
+	char *end;
+	long long size;
+	int shift;
+
+	errno = 0;
+	size = strtoll(str, &end, 0);
+	if (size < 0 || end == str)
+		return -EINVAL;
+	if (errno == ERANGE)
+		return -ERANGE;
+
+	switch (*end) {
+	case '\0':
+	case 'b':
+		shift = 0;
+		break;
+	case 'k':
+	case 'K':
+		shift = 10;
+		break;
+	case 'm':
+	case 'M':
+		shift = 20;
+		break;
+	case 'g':
+	case 'G':
+		shift = 30;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (*end && end[1])
+		return -EINVAL;
+
+	if (size > (SSIZE_MAX >> shift))
+		return -ERANGE;
+
+	return size << shift;
+}
+
+long str_to_msecs(const char *str, long unit)
+{
+	char *end;
+	long msecs;
+
+	msecs = strtol(str, &end, 0);
+	if (msecs < 0 || end == str)
+		return -EINVAL;
+
+	if (!*end)
+		return msecs * unit;
+	else if (!strcmp(end, "ms"))
+		return msecs;
+	else if (!strcmp(end, "s"))
+		return msecs * 1000;
+	else if (!strcmp(end, "m"))
+		return msecs * 60 * 1000;
+
+	return -EINVAL;
+}
+
+/* per-cpu maps hold a value for every possible cpu, which can be
+ * more than the ones that are online. */
+int cpus_possible(void)
+{
+	static int ncpus;
+	unsigned int lo, hi;
+	FILE *fp;
+
+	if (ncpus)
+		return ncpus;
+
+	fp = fopen("/sys/devices/system/cpu/possible", "r");
+	if (fp) {
+		/* a range, or a single cpu */
+		switch (fscanf(fp, "%u-%u", &lo, &hi)) {
+		case 2:
+			ncpus = hi + 1;
+			break;
+		case 1:
+			ncpus = lo + 1;
+			break;
+		}
+
+		fclose(fp);
+	}
+
+	if (!ncpus)
+		ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	return ncpus;
+}